@@ -8,20 +8,63 @@
  */
 
 #define STATUS_STEP_SIZE 5.0
+#define PROFILE_STRINGS_CHUNK_SIZE 512
+
+#include <string.h>
 
 #include "audio_status.h"
+#include "trace.h"
+
+typedef struct {
+    GHashTable *by_index;
+    GHashTable *by_name;
+} device_table;
 
 audio_status status;
 
+static device_table sinks, sources;
+static GHashTable *sink_inputs = NULL;
+static GHashTable *cards = NULL;
+static guint64 last_layout = 0;
+
+static void device_destroy(gpointer data);
+static void stream_destroy(gpointer data);
+static void card_destroy(gpointer data);
+
+static void device_table_init(device_table *table)
+{
+    table->by_index = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, device_destroy);
+    table->by_name = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void device_table_destroy(device_table *table)
+{
+    g_hash_table_destroy(table->by_name);
+    g_hash_table_destroy(table->by_index);
+}
+
 void audio_status_init(void)
 {
     status.volume = 0.0;
     status.muted = TRUE;
+    status.card = NULL;
+    device_table_init(&sinks);
+    device_table_init(&sources);
+    sink_inputs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, stream_destroy);
+    cards = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, card_destroy);
 }
 
 void audio_status_destroy(void)
 {
-    audio_status_reset_profiles();
+    audio_status_reset_registry();
+    device_table_destroy(&sinks);
+    device_table_destroy(&sources);
+    g_hash_table_destroy(sink_inputs);
+    sink_inputs = NULL;
+    g_hash_table_destroy(cards);
+    cards = NULL;
 }
 
 audio_status *shared_audio_status(void)
@@ -29,39 +72,259 @@ audio_status *shared_audio_status(void)
     return &status;
 }
 
-static void profile_destroy(gpointer *data)
+void audio_status_raise_volume(void)
 {
-    audio_status_profile *profile = (audio_status_profile *)data;
-    g_free(profile->name);
-    g_free(profile->description);
-    g_free(profile);
+    audio_status_step_volume(1.0);
 }
 
-void audio_status_raise_volume(void)
+void audio_status_lower_volume(void)
 {
-    status.volume += STATUS_STEP_SIZE;
-    if (status.volume > 100.0)
-        status.volume = 100.0;
+    audio_status_step_volume(-1.0);
 }
 
-void audio_status_lower_volume(void)
+void audio_status_step_volume(gdouble steps)
 {
-    status.volume -= STATUS_STEP_SIZE;
-    if (status.volume < 0.0)
+    trace_instant("state", "step_volume");
+    status.volume += steps * STATUS_STEP_SIZE;
+    if (status.volume > 100.0)
+        status.volume = 100.0;
+    else if (status.volume < 0.0)
         status.volume = 0.0;
 }
 
 void audio_status_toggle_muted(void)
 {
+    trace_instant("state", "toggle_muted");
     status.muted = !status.muted;
 }
 
-void audio_status_reset_profiles(void)
+audio_status_profile *audio_status_get_profiles(guint *num_profiles)
+{
+    // The profiles of the current card, sorted by priority
+    if (!status.card || !status.card->profiles->len) {
+        *num_profiles = 0;
+        return NULL;
+    }
+    *num_profiles = status.card->profiles->len;
+    return &g_array_index(status.card->profiles, audio_status_profile, 0);
+}
+
+audio_status_profile *audio_status_get_active_profile(void)
+{
+    if (!status.card || status.card->active_profile < 0)
+        return NULL;
+    return &g_array_index(status.card->profiles, audio_status_profile,
+            status.card->active_profile);
+}
+
+void audio_status_set_active_profile(audio_status_profile *profile)
+{
+    // Make the profile the only active one of the current card
+    audio_status_profile *active = audio_status_get_active_profile();
+    if (active)
+        active->active = FALSE;
+    profile->active = TRUE;
+    status.card->active_profile = profile - &g_array_index(status.card->profiles,
+            audio_status_profile, 0);
+}
+
+static void device_destroy(gpointer data)
+{
+    audio_status_device *device = (audio_status_device *)data;
+    g_free(device->name);
+    g_free(device->description);
+    g_free(device->monitor_source_name);
+    g_free(device);
+}
+
+static void replace_string(gchar **dest, const gchar *src)
+{
+    // Avoid reallocating strings that didn't change
+    if (g_strcmp0(*dest, src)) {
+        g_free(*dest);
+        *dest = g_strdup(src);
+    }
+}
+
+static audio_status_device *device_table_store(device_table *table,
+        const audio_status_device *info)
+{
+    // Add the device if we don't know about it yet
+    audio_status_device *device = g_hash_table_lookup(table->by_index,
+            GUINT_TO_POINTER(info->index));
+    if (!device) {
+        device = g_malloc0(sizeof(audio_status_device));
+        device->index = info->index;
+        g_hash_table_insert(table->by_index, GUINT_TO_POINTER(info->index), device);
+    }
+
+    // Keep the name index up to date
+    if (g_strcmp0(device->name, info->name)) {
+        if (device->name)
+            g_hash_table_remove(table->by_name, device->name);
+        replace_string(&device->name, info->name);
+        g_hash_table_insert(table->by_name, device->name, device);
+    }
+
+    // Update everything else
+    replace_string(&device->description, info->description);
+    replace_string(&device->monitor_source_name, info->monitor_source_name);
+    device->card = info->card;
+    device->channels = info->channels;
+    device->volume = info->volume;
+    device->muted = info->muted;
+
+    return device;
+}
+
+static void device_table_remove(device_table *table, uint32_t index)
+{
+    audio_status_device *device = g_hash_table_lookup(table->by_index,
+            GUINT_TO_POINTER(index));
+    if (!device)
+        return;
+    if (device->name)
+        g_hash_table_remove(table->by_name, device->name);
+    g_hash_table_remove(table->by_index, GUINT_TO_POINTER(index));
+}
+
+audio_status_device *audio_status_store_sink(const audio_status_device *info)
+{
+    return device_table_store(&sinks, info);
+}
+
+audio_status_device *audio_status_lookup_sink(uint32_t index)
+{
+    return g_hash_table_lookup(sinks.by_index, GUINT_TO_POINTER(index));
+}
+
+audio_status_device *audio_status_lookup_sink_by_name(const gchar *name)
+{
+    return g_hash_table_lookup(sinks.by_name, name);
+}
+
+void audio_status_remove_sink(uint32_t index)
+{
+    device_table_remove(&sinks, index);
+}
+
+void audio_status_foreach_sink(GHFunc func, gpointer data)
+{
+    g_hash_table_foreach(sinks.by_index, func, data);
+}
+
+audio_status_device *audio_status_store_source(const audio_status_device *info)
 {
-    if (status.profiles) {
-        g_slist_free_full(status.profiles, (GDestroyNotify)profile_destroy);
-        status.profiles = NULL;
+    return device_table_store(&sources, info);
+}
+
+audio_status_device *audio_status_lookup_source(uint32_t index)
+{
+    return g_hash_table_lookup(sources.by_index, GUINT_TO_POINTER(index));
+}
+
+audio_status_device *audio_status_lookup_source_by_name(const gchar *name)
+{
+    return g_hash_table_lookup(sources.by_name, name);
+}
+
+void audio_status_remove_source(uint32_t index)
+{
+    device_table_remove(&sources, index);
+}
+
+static void stream_destroy(gpointer data)
+{
+    audio_status_stream *stream = (audio_status_stream *)data;
+    g_free(stream->name);
+    g_free(stream);
+}
+
+audio_status_stream *audio_status_store_sink_input(const audio_status_stream *info)
+{
+    // Add the stream if we don't know about it yet, or update it in place
+    audio_status_stream *stream = audio_status_lookup_sink_input(info->index);
+    if (!stream) {
+        stream = g_malloc0(sizeof(audio_status_stream));
+        stream->index = info->index;
+        g_hash_table_insert(sink_inputs, GUINT_TO_POINTER(info->index), stream);
+    }
+    replace_string(&stream->name, info->name);
+    stream->sink = info->sink;
+    stream->channels = info->channels;
+    stream->volume = info->volume;
+    stream->muted = info->muted;
+    stream->volume_writable = info->volume_writable;
+    return stream;
+}
+
+audio_status_stream *audio_status_lookup_sink_input(uint32_t index)
+{
+    return g_hash_table_lookup(sink_inputs, GUINT_TO_POINTER(index));
+}
+
+void audio_status_remove_sink_input(uint32_t index)
+{
+    g_hash_table_remove(sink_inputs, GUINT_TO_POINTER(index));
+}
+
+void audio_status_foreach_sink_input(GHFunc func, gpointer data)
+{
+    g_hash_table_foreach(sink_inputs, func, data);
+}
+
+static void card_destroy(gpointer data)
+{
+    audio_status_card *card = (audio_status_card *)data;
+    g_hash_table_destroy(card->profile_table);
+    g_array_free(card->profiles, TRUE);
+    g_string_chunk_free(card->strings);
+    g_free(card->name);
+    g_free(card);
+}
+
+audio_status_card *audio_status_store_card(uint32_t index, const gchar *name)
+{
+    // Add the card if we don't know about it yet
+    audio_status_card *card = audio_status_lookup_card(index);
+    if (!card) {
+        card = g_malloc0(sizeof(audio_status_card));
+        card->index = index;
+        card->profiles = g_array_new(FALSE, FALSE, sizeof(audio_status_profile));
+        card->strings = g_string_chunk_new(PROFILE_STRINGS_CHUNK_SIZE);
+        card->profile_table = g_hash_table_new(g_str_hash, g_str_equal);
+        card->active_profile = -1;
+        card->layout = ++last_layout;
+        g_hash_table_insert(cards, GUINT_TO_POINTER(index), card);
     }
+    replace_string(&card->name, name);
+    return card;
+}
+
+audio_status_card *audio_status_lookup_card(uint32_t index)
+{
+    return g_hash_table_lookup(cards, GUINT_TO_POINTER(index));
+}
+
+void audio_status_remove_card(uint32_t index)
+{
+    audio_status_card *card = audio_status_lookup_card(index);
+    if (!card)
+        return;
+    if (status.card == card)
+        status.card = NULL;
+    g_hash_table_remove(cards, GUINT_TO_POINTER(index));
+}
+
+void audio_status_reset_registry(void)
+{
+    status.card = NULL;
+    g_hash_table_remove_all(sinks.by_name);
+    g_hash_table_remove_all(sinks.by_index);
+    g_hash_table_remove_all(sources.by_name);
+    g_hash_table_remove_all(sources.by_index);
+    g_hash_table_remove_all(sink_inputs);
+    g_hash_table_remove_all(cards);
 }
 
 static gint profile_compare_func(gconstpointer a, gconstpointer b)
@@ -76,8 +339,109 @@ static gint profile_compare_func(gconstpointer a, gconstpointer b)
         return 0;
 }
 
-void audio_status_sort_profiles(void)
+audio_status_profile *audio_status_card_lookup_profile(audio_status_card *card,
+        const gchar *name)
+{
+    // The table maps the names to their positions in the array, plus one
+    guint position = GPOINTER_TO_UINT(g_hash_table_lookup(card->profile_table, name));
+    if (!position)
+        return NULL;
+    return &g_array_index(card->profiles, audio_status_profile, position - 1);
+}
+
+void audio_status_card_begin_profile_update(audio_status_card *card)
+{
+    // Profiles that aren't updated until the end of this generation
+    // are the ones that no longer exist
+    ++card->generation;
+    card->profiles_changed = FALSE;
+    card->profiles_need_sorting = FALSE;
+}
+
+void audio_status_card_update_profile(audio_status_card *card, const gchar *name,
+        const gchar *description, uint32_t priority, gboolean available, gboolean active)
 {
-    if (status.profiles)
-        status.profiles = g_slist_sort(status.profiles, profile_compare_func);
+    // Add the profile if we don't know about it yet. The strings live in
+    // the arena of the card, until the card itself goes away
+    audio_status_profile *profile = audio_status_card_lookup_profile(card, name);
+    if (!profile) {
+        audio_status_profile new_profile;
+        new_profile.name = g_string_chunk_insert_const(card->strings, name);
+        new_profile.description = g_string_chunk_insert_const(card->strings, description);
+        new_profile.priority = priority;
+        new_profile.available = available;
+        new_profile.active = active;
+        new_profile.generation = card->generation;
+        g_array_append_val(card->profiles, new_profile);
+        g_hash_table_insert(card->profile_table, (gpointer)new_profile.name,
+                GUINT_TO_POINTER(card->profiles->len));
+        card->profiles_changed = TRUE;
+        card->profiles_need_sorting = TRUE;
+        return;
+    }
+
+    // Otherwise update it in place, taking note of what changed
+    profile->generation = card->generation;
+    if (strcmp(profile->description, description)) {
+        profile->description = g_string_chunk_insert_const(card->strings, description);
+        card->profiles_changed = TRUE;
+    }
+    if (profile->priority != priority) {
+        profile->priority = priority;
+        card->profiles_changed = TRUE;
+        card->profiles_need_sorting = TRUE;
+    }
+    if (profile->available != available) {
+        profile->available = available;
+        card->profiles_changed = TRUE;
+    }
+    if (profile->active != active) {
+        profile->active = active;
+        card->profiles_changed = TRUE;
+    }
+}
+
+gboolean audio_status_card_end_profile_update(audio_status_card *card)
+{
+    // Get rid of the profiles that weren't updated, keeping the array
+    // contiguous. Their strings stay in the arena, profiles that come
+    // back share them
+    guint kept = 0;
+    for (guint i = 0; i < card->profiles->len; ++i) {
+        audio_status_profile *profile = &g_array_index(card->profiles, audio_status_profile, i);
+        if (profile->generation != card->generation) {
+            g_hash_table_remove(card->profile_table, profile->name);
+            card->profiles_changed = TRUE;
+            card->profiles_need_sorting = TRUE;
+            continue;
+        }
+        if (kept != i)
+            g_array_index(card->profiles, audio_status_profile, kept) = *profile;
+        ++kept;
+    }
+    g_array_set_size(card->profiles, kept);
+
+    // Keep the profiles sorted by priority, and the positions in the
+    // table in sync with the array
+    if (card->profiles_need_sorting) {
+        g_array_sort(card->profiles, profile_compare_func);
+        for (guint i = 0; i < card->profiles->len; ++i) {
+            audio_status_profile *profile = &g_array_index(card->profiles,
+                    audio_status_profile, i);
+            g_hash_table_insert(card->profile_table, (gpointer)profile->name,
+                    GUINT_TO_POINTER(i + 1));
+        }
+        card->layout = ++last_layout;
+    }
+
+    // Remember which profile is the active one
+    card->active_profile = -1;
+    for (guint i = 0; i < card->profiles->len; ++i) {
+        if (g_array_index(card->profiles, audio_status_profile, i).active) {
+            card->active_profile = i;
+            break;
+        }
+    }
+
+    return card->profiles_changed;
 }
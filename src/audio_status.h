@@ -14,28 +14,95 @@
 #include <stdint.h>
 
 typedef struct {
+    const gchar *name;
+    const gchar *description;
+    uint32_t priority;
+    gboolean available;
+    gboolean active;
+    guint generation;
+} audio_status_profile;
+
+typedef struct {
+    uint32_t index;
+    gchar *name;
+    GArray *profiles;
+    GStringChunk *strings;
+    GHashTable *profile_table;
+    gint active_profile;
+    guint generation;
+    guint64 layout;
+    gboolean profiles_changed;
+    gboolean profiles_need_sorting;
+} audio_status_card;
+
+typedef struct {
+    uint32_t index;
+    gchar *name;
+    gchar *description;
+    gchar *monitor_source_name;
+    uint32_t card;
+    uint8_t channels;
     gdouble volume;
     gboolean muted;
-    GSList *profiles;
-} audio_status;
+} audio_status_device;
 
 typedef struct {
+    uint32_t index;
     gchar *name;
-    gchar *description;
-    uint32_t priority;
-    gboolean active;
-} audio_status_profile;
+    uint32_t sink;
+    uint8_t channels;
+    gdouble volume;
+    gboolean muted;
+    gboolean volume_writable;
+} audio_status_stream;
+
+typedef struct {
+    gdouble volume;
+    gboolean muted;
+    audio_status_card *card;
+} audio_status;
 
 audio_status *shared_audio_status(void);
 
 void audio_status_init(void);
 void audio_status_destroy(void);
 
-void audio_status_reset_profiles(void);
-void audio_status_sort_profiles(void);
-
 void audio_status_raise_volume(void);
 void audio_status_lower_volume(void);
+void audio_status_step_volume(gdouble steps);
 void audio_status_toggle_muted(void);
 
+audio_status_profile *audio_status_get_profiles(guint *num_profiles);
+audio_status_profile *audio_status_get_active_profile(void);
+void audio_status_set_active_profile(audio_status_profile *profile);
+
+audio_status_device *audio_status_store_sink(const audio_status_device *info);
+audio_status_device *audio_status_lookup_sink(uint32_t index);
+audio_status_device *audio_status_lookup_sink_by_name(const gchar *name);
+void audio_status_remove_sink(uint32_t index);
+void audio_status_foreach_sink(GHFunc func, gpointer data);
+
+audio_status_device *audio_status_store_source(const audio_status_device *info);
+audio_status_device *audio_status_lookup_source(uint32_t index);
+audio_status_device *audio_status_lookup_source_by_name(const gchar *name);
+void audio_status_remove_source(uint32_t index);
+
+audio_status_stream *audio_status_store_sink_input(const audio_status_stream *info);
+audio_status_stream *audio_status_lookup_sink_input(uint32_t index);
+void audio_status_remove_sink_input(uint32_t index);
+void audio_status_foreach_sink_input(GHFunc func, gpointer data);
+
+audio_status_card *audio_status_store_card(uint32_t index, const gchar *name);
+audio_status_card *audio_status_lookup_card(uint32_t index);
+void audio_status_remove_card(uint32_t index);
+
+void audio_status_reset_registry(void);
+
+audio_status_profile *audio_status_card_lookup_profile(audio_status_card *card,
+        const gchar *name);
+void audio_status_card_begin_profile_update(audio_status_card *card);
+void audio_status_card_update_profile(audio_status_card *card, const gchar *name,
+        const gchar *description, uint32_t priority, gboolean available, gboolean active);
+gboolean audio_status_card_end_profile_update(audio_status_card *card);
+
 #endif
@@ -0,0 +1,623 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#define BENCH_VOLUME_WRITES 2000
+#define BENCH_LATENCY_ROUNDS 100
+#define BENCH_STORM_SINKS 200
+#define BENCH_TIMEOUT (10 * G_USEC_PER_SEC)
+#define BENCH_SINK_NAME "bench"
+#define BENCH_PEAK_SECONDS 5
+#define BENCH_WARM_UP_CYCLES 20
+#define BENCH_ALLOCATION_CYCLES 200
+
+// How much CPU time the level meter may cost the applet and the server,
+// in milliseconds per second of it being shown
+#define PEAK_METER_CPU_BUDGET 5.0
+
+#include <dlfcn.h>
+#include <glib.h>
+#include <pulse/glib-mainloop.h>
+#include <pulse/pulseaudio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "audio_status.h"
+#include "key_grabber.h"
+#include "popup_menu.h"
+#include "pulse_glue.h"
+#include "stream_mixer.h"
+#include "tray_icon.h"
+#include "ui_refresh.h"
+#include "volume_scale.h"
+
+static gint64 first_status_time = 0;
+static gdouble awaited_volume = -1.0;
+static gboolean storm_running = FALSE;
+static unsigned int storm_pending = 0;
+static pa_context_state_t external_state = PA_CONTEXT_UNCONNECTED;
+static guint64 level_updates = 0;
+static gdouble refreshed_volume = -1.0;
+
+// Allocations are counted while this is set, telling the ones made by
+// libpulse for the protocol traffic from everything else
+static gboolean counting_allocations = FALSE, in_allocation_hook = FALSE;
+static guint64 applet_allocations = 0, libpulse_allocations = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static void count_allocation(void *caller)
+{
+    if (!counting_allocations || in_allocation_hook)
+        return;
+
+    // Find out which library the caller belongs to, without counting
+    // whatever dladdr() might allocate itself
+    in_allocation_hook = TRUE;
+    Dl_info info;
+    if (dladdr(caller, &info) && info.dli_fname && strstr(info.dli_fname, "libpulse"))
+        ++libpulse_allocations;
+    else
+        ++applet_allocations;
+    in_allocation_hook = FALSE;
+}
+
+void *malloc(size_t size)
+{
+    count_allocation(__builtin_return_address(0));
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    count_allocation(__builtin_return_address(0));
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    count_allocation(__builtin_return_address(0));
+    return __libc_realloc(ptr, size);
+}
+
+// The widgets are replaced by these. The tray icon and the UI refresh are
+// the real ones, they just have no widgets to touch
+
+void update_volume_scale(void)
+{
+    ui_refresh_invalidate(UI_REFRESH_VOLUME_SCALE);
+}
+
+void render_volume_scale(void)
+{
+    refreshed_volume = shared_audio_status()->volume;
+}
+
+void update_volume_scale_level(gdouble level)
+{
+    ++level_updates;
+}
+
+void render_volume_scale_level(void)
+{
+}
+
+void show_volume_scale(GdkRectangle *rect_or_null)
+{
+}
+
+void flash_volume_scale(GdkRectangle *rect_or_null)
+{
+}
+
+void hide_volume_scale(void)
+{
+}
+
+gboolean is_volume_scale_visible(void)
+{
+    return FALSE;
+}
+
+void destroy_volume_scale(void)
+{
+}
+
+void update_popup_menu(void)
+{
+}
+
+void show_popup_menu(GtkStatusIcon *status_icon)
+{
+}
+
+void hide_popup_menu(void)
+{
+}
+
+gboolean is_popup_menu_visible(void)
+{
+    return FALSE;
+}
+
+void destroy_popup_menu(void)
+{
+}
+
+void update_stream_mixer(void)
+{
+}
+
+void update_stream_mixer_stream(uint32_t index)
+{
+}
+
+void render_stream_mixer(void)
+{
+}
+
+void control_socket_state_changed(void)
+{
+}
+
+static gboolean wake_up(gpointer data)
+{
+    return TRUE;
+}
+
+static gboolean run_until(gboolean (*done)(void))
+{
+    // Iterate the main loop until the condition is met or we time out,
+    // waking up regularly so that the timeout is honored
+    guint wake_up_id = g_timeout_add(10, wake_up, NULL);
+    gint64 deadline = g_get_monotonic_time() + BENCH_TIMEOUT;
+    gboolean met;
+    while (!(met = done()) && g_get_monotonic_time() < deadline)
+        g_main_context_iteration(NULL, TRUE);
+    g_source_remove(wake_up_id);
+    return met;
+}
+
+static void on_first_icon(void)
+{
+    first_status_time = g_get_monotonic_time();
+}
+
+static gboolean have_status(void)
+{
+    return first_status_time != 0;
+}
+
+static gboolean have_awaited_volume(void)
+{
+    // Look at what the server reported, not at what we asked for
+    audio_status_device *sink = audio_status_lookup_sink_by_name(BENCH_SINK_NAME);
+    if (!sink)
+        return FALSE;
+    gdouble delta = sink->volume - awaited_volume;
+    return delta > -0.5 && delta < 0.5;
+}
+
+static gboolean storm_done(void)
+{
+    return !storm_running;
+}
+
+static gdouble cpu_time(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+        usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+static gdouble server_cpu_time(void)
+{
+    // The script that runs us tells us which process the server is
+    const gchar *pid = g_getenv("PA_BENCH_SERVER_PID");
+    if (!pid)
+        return -1.0;
+    gchar *path = g_strdup_printf("/proc/%s/stat", pid);
+    gchar *contents = NULL;
+    gboolean read = g_file_get_contents(path, &contents, NULL, NULL);
+    g_free(path);
+    if (!read)
+        return -1.0;
+
+    // The user and system times are the 12th and 13th fields after the
+    // command name
+    gdouble cpu = -1.0;
+    gchar *fields = strrchr(contents, ')');
+    if (fields) {
+        gchar **tokens = g_strsplit(fields + 2, " ", 14);
+        if (g_strv_length(tokens) > 12) {
+            guint64 ticks = g_ascii_strtoull(tokens[11], NULL, 10) +
+                g_ascii_strtoull(tokens[12], NULL, 10);
+            cpu = ticks * 1000.0 / sysconf(_SC_CLK_TCK);
+        }
+        g_strfreev(tokens);
+    }
+    g_free(contents);
+    return cpu;
+}
+
+static gint compare_latencies(gconstpointer a, gconstpointer b)
+{
+    gint64 latency_a = *(const gint64 *)a, latency_b = *(const gint64 *)b;
+    return latency_a < latency_b ? -1 : latency_a > latency_b;
+}
+
+static gboolean bench_startup(void)
+{
+    // Measure the time from starting up to showing the first icon
+    gint64 start = g_get_monotonic_time();
+    set_tray_icon_shown_callback(on_first_icon);
+    pulse_glue_start();
+    if (!run_until(have_status)) {
+        g_printerr("Timed out waiting for the first status\n");
+        return FALSE;
+    }
+    g_print("  \"startup_us\": %" G_GINT64_FORMAT ",\n", first_status_time - start);
+    return TRUE;
+}
+
+static gboolean bench_volume_writes(void)
+{
+    // Fire volume changes as fast as the main loop allows, then wait for
+    // the last one (a value not used before) to be echoed back
+    audio_status *as = shared_audio_status();
+    pulse_glue_write_stats before, after;
+    pulse_glue_get_write_stats(&before);
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < BENCH_VOLUME_WRITES; ++i) {
+        as->volume = i % 90;
+        pulse_glue_sync_volume();
+        g_main_context_iteration(NULL, FALSE);
+    }
+    as->volume = awaited_volume = 95.0;
+    pulse_glue_sync_volume();
+    if (!run_until(have_awaited_volume)) {
+        g_printerr("Timed out waiting for the volume writes to complete\n");
+        return FALSE;
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    pulse_glue_get_write_stats(&after);
+
+    g_print("  \"volume_writes\": {\n");
+    g_print("    \"requested\": %d,\n", BENCH_VOLUME_WRITES + 1);
+    g_print("    \"issued\": %" G_GUINT64_FORMAT ",\n",
+            after.volume_writes_issued - before.volume_writes_issued);
+    g_print("    \"coalesced\": %" G_GUINT64_FORMAT ",\n",
+            after.volume_writes_coalesced - before.volume_writes_coalesced);
+    g_print("    \"elapsed_us\": %" G_GINT64_FORMAT ",\n", elapsed);
+    g_print("    \"requests_per_second\": %.1f\n",
+            (BENCH_VOLUME_WRITES + 1) * (gdouble)G_USEC_PER_SEC / elapsed);
+    g_print("  },\n");
+    return TRUE;
+}
+
+static gboolean bench_external_latency(pa_context *external)
+{
+    // Change the volume from another client and measure how long it
+    // takes for the change to show up
+    gint64 latencies[BENCH_LATENCY_ROUNDS];
+    for (int i = 0; i < BENCH_LATENCY_ROUNDS; ++i) {
+        awaited_volume = i % 2 ? 20.0 : 80.0;
+        pa_cvolume volume;
+        pa_cvolume_init(&volume);
+        pa_cvolume_set(&volume, 1, awaited_volume * PA_VOLUME_NORM / 100);
+
+        gint64 start = g_get_monotonic_time();
+        pa_operation *oper = pa_context_set_sink_volume_by_name(external,
+                BENCH_SINK_NAME, &volume, NULL, NULL);
+        if (!oper) {
+            g_printerr("pa_context_set_sink_volume_by_name() failed\n");
+            return FALSE;
+        }
+        pa_operation_unref(oper);
+        if (!run_until(have_awaited_volume)) {
+            g_printerr("Timed out waiting for an external volume change\n");
+            return FALSE;
+        }
+        latencies[i] = g_get_monotonic_time() - start;
+    }
+
+    qsort(latencies, BENCH_LATENCY_ROUNDS, sizeof(gint64), compare_latencies);
+    g_print("  \"external_change_latency_us\": {\n");
+    g_print("    \"min\": %" G_GINT64_FORMAT ",\n", latencies[0]);
+    g_print("    \"median\": %" G_GINT64_FORMAT ",\n", latencies[BENCH_LATENCY_ROUNDS / 2]);
+    g_print("    \"p95\": %" G_GINT64_FORMAT ",\n", latencies[BENCH_LATENCY_ROUNDS * 95 / 100]);
+    g_print("    \"max\": %" G_GINT64_FORMAT "\n", latencies[BENCH_LATENCY_ROUNDS - 1]);
+    g_print("  },\n");
+    return TRUE;
+}
+
+static void storm_exited(GPid pid, gint status, gpointer data)
+{
+    g_spawn_close_pid(pid);
+    storm_running = FALSE;
+}
+
+static gboolean bench_event_storm(void)
+{
+    // Run the storm in a separate process so that only our own handling
+    // of the events is accounted for
+    gchar *self = g_file_read_link("/proc/self/exe", NULL);
+    gchar *count = g_strdup_printf("%d", BENCH_STORM_SINKS);
+    gchar *argv[] = { self, "--storm", count, NULL };
+    GPid pid;
+    GError *error = NULL;
+
+    pulse_glue_reload_stats before, after;
+    pulse_glue_get_reload_stats(&before);
+    gdouble cpu_before = cpu_time();
+    gint64 start = g_get_monotonic_time();
+    gboolean spawned = self && g_spawn_async(NULL, argv, NULL,
+            G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, &error);
+    g_free(self);
+    g_free(count);
+    if (!spawned) {
+        g_printerr("Failed to start the event storm: %s\n",
+                error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return FALSE;
+    }
+    storm_running = TRUE;
+    g_child_watch_add(pid, storm_exited, NULL);
+    if (!run_until(storm_done)) {
+        g_printerr("Timed out waiting for the event storm\n");
+        return FALSE;
+    }
+
+    // Let the queries triggered by the last events complete
+    awaited_volume = 50.0;
+    shared_audio_status()->volume = awaited_volume;
+    pulse_glue_sync_volume();
+    run_until(have_awaited_volume);
+    gint64 elapsed = g_get_monotonic_time() - start;
+    gdouble cpu = cpu_time() - cpu_before;
+    pulse_glue_get_reload_stats(&after);
+
+    g_print("  \"event_storm\": {\n");
+    g_print("    \"sinks\": %d,\n", BENCH_STORM_SINKS);
+    g_print("    \"events\": %" G_GUINT64_FORMAT ",\n", after.events - before.events);
+    g_print("    \"queries\": %" G_GUINT64_FORMAT ",\n", after.reloads - before.reloads);
+    g_print("    \"elapsed_us\": %" G_GINT64_FORMAT ",\n", elapsed);
+    g_print("    \"cpu_ms\": %.1f\n", cpu);
+    g_print("  }\n");
+    return TRUE;
+}
+
+static void measure_idle(gint64 duration, gdouble *cpu, gdouble *server_cpu)
+{
+    // Let the main loop run for a while, accounting for the CPU time it
+    // takes here and in the server
+    gdouble cpu_before = cpu_time(), server_cpu_before = server_cpu_time();
+    gint64 deadline = g_get_monotonic_time() + duration;
+    guint wake_up_id = g_timeout_add(10, wake_up, NULL);
+    while (g_get_monotonic_time() < deadline)
+        g_main_context_iteration(NULL, TRUE);
+    g_source_remove(wake_up_id);
+    *cpu = cpu_time() - cpu_before;
+    *server_cpu = server_cpu_before < 0.0 ? -1.0 : server_cpu_time() - server_cpu_before;
+}
+
+static gboolean bench_peak_meter(void)
+{
+    // Compare the cost of just sitting there with the cost of sitting
+    // there with the level meter running
+    gdouble seconds = BENCH_PEAK_SECONDS;
+    gdouble idle_cpu, idle_server_cpu, meter_cpu, meter_server_cpu;
+    measure_idle(BENCH_PEAK_SECONDS * G_USEC_PER_SEC, &idle_cpu, &idle_server_cpu);
+    guint64 updates_before = level_updates;
+    pulse_glue_start_peak_monitor();
+    measure_idle(BENCH_PEAK_SECONDS * G_USEC_PER_SEC, &meter_cpu, &meter_server_cpu);
+    pulse_glue_stop_peak_monitor();
+
+    gdouble cost = (meter_cpu - idle_cpu) / seconds;
+    gdouble server_cost = (meter_server_cpu - idle_server_cpu) / seconds;
+    gboolean have_server_cost = idle_server_cpu >= 0.0 && meter_server_cpu >= 0.0;
+    gboolean within_budget = cost <= PEAK_METER_CPU_BUDGET &&
+        (!have_server_cost || server_cost <= PEAK_METER_CPU_BUDGET);
+
+    g_print("  \"peak_meter\": {\n");
+    g_print("    \"updates_per_second\": %.1f,\n",
+            (level_updates - updates_before) / seconds);
+    g_print("    \"cpu_ms_per_second\": %.2f,\n", cost);
+    if (have_server_cost)
+        g_print("    \"server_cpu_ms_per_second\": %.2f,\n", server_cost);
+    g_print("    \"budget_ms_per_second\": %.2f,\n", PEAK_METER_CPU_BUDGET);
+    g_print("    \"within_budget\": %s\n", within_budget ? "true" : "false");
+    g_print("  },\n");
+    if (!within_budget)
+        g_printerr("The level meter is over its CPU budget\n");
+    return within_budget;
+}
+
+static void volume_key_pressed(gdouble steps)
+{
+    // What the volume keys do in the applet, minus the notification
+    audio_status_step_volume(steps);
+    awaited_volume = shared_audio_status()->volume;
+    pulse_glue_sync_volume();
+}
+
+static void volume_lower_key_pressed(gdouble steps)
+{
+    volume_key_pressed(-steps);
+}
+
+static gboolean cycle_done(void)
+{
+    // The server echoed the volume and the UI was refreshed with it
+    gdouble delta = refreshed_volume - awaited_volume;
+    return have_awaited_volume() && delta > -0.5 && delta < 0.5;
+}
+
+static gboolean bench_allocations(void)
+{
+    // Go through the volume change cycle over and over: press a volume
+    // key, let the press be dispatched, write the volume, wait for the
+    // server to echo it back and for the tray icon and the volume scale
+    // to be refreshed. Once warm, none of it should allocate anything
+    // outside of libpulse. Only the X events and the widgets are left out
+    shared_audio_status()->volume = 50.0;
+    key_grabber_register_callback(KEY_GRABBER_VOLUME_RAISE, volume_key_pressed);
+    key_grabber_register_callback(KEY_GRABBER_VOLUME_LOWER, volume_lower_key_pressed);
+    guint wake_up_id = g_timeout_add(10, wake_up, NULL);
+    gboolean done = TRUE;
+    for (int i = 0; done && i < BENCH_WARM_UP_CYCLES + BENCH_ALLOCATION_CYCLES; ++i) {
+        if (i == BENCH_WARM_UP_CYCLES) {
+            applet_allocations = libpulse_allocations = 0;
+            counting_allocations = TRUE;
+        }
+        key_grabber_queue_press(i % 2 ? KEY_GRABBER_VOLUME_LOWER : KEY_GRABBER_VOLUME_RAISE, 1.0);
+        awaited_volume = -1.0;
+        gint64 deadline = g_get_monotonic_time() + BENCH_TIMEOUT;
+        while (!(done = cycle_done()) && g_get_monotonic_time() < deadline)
+            g_main_context_iteration(NULL, TRUE);
+    }
+    counting_allocations = FALSE;
+    g_source_remove(wake_up_id);
+    if (!done) {
+        g_printerr("Timed out waiting for a volume change to be echoed and shown\n");
+        return FALSE;
+    }
+
+    g_print("  \"allocations\": {\n");
+    g_print("    \"cycles\": %d,\n", BENCH_ALLOCATION_CYCLES);
+    g_print("    \"applet_per_cycle\": %.2f,\n",
+            applet_allocations / (gdouble)BENCH_ALLOCATION_CYCLES);
+    g_print("    \"libpulse_per_cycle\": %.2f\n",
+            libpulse_allocations / (gdouble)BENCH_ALLOCATION_CYCLES);
+    g_print("  },\n");
+    if (applet_allocations)
+        g_printerr("The volume change cycle allocated memory once warm\n");
+    return applet_allocations == 0;
+}
+
+static void storm_module_loaded(pa_context *c, uint32_t idx, void *data)
+{
+    *(uint32_t *)data = idx;
+    --storm_pending;
+}
+
+static void storm_module_unloaded(pa_context *c, int success, void *data)
+{
+    --storm_pending;
+}
+
+static int run_storm(int num_sinks)
+{
+    // Connect to the server with a plain main loop
+    pa_mainloop *ml = pa_mainloop_new();
+    pa_context *c = pa_context_new(pa_mainloop_get_api(ml), "pa-applet-bench-storm");
+    if (pa_context_connect(c, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0)
+        return EXIT_FAILURE;
+    while (pa_context_get_state(c) != PA_CONTEXT_READY) {
+        if (pa_context_get_state(c) == PA_CONTEXT_FAILED)
+            return EXIT_FAILURE;
+        pa_mainloop_iterate(ml, 1, NULL);
+    }
+
+    // Create all the sinks at once, like a dock full of devices would
+    uint32_t *modules = g_new(uint32_t, num_sinks);
+    for (int i = 0; i < num_sinks; ++i) {
+        gchar *args = g_strdup_printf("sink_name=storm%d", i);
+        pa_operation *oper = pa_context_load_module(c, "module-null-sink",
+                args, storm_module_loaded, &modules[i]);
+        g_free(args);
+        if (oper) {
+            pa_operation_unref(oper);
+            ++storm_pending;
+        }
+        else {
+            modules[i] = PA_INVALID_INDEX;
+        }
+    }
+    while (storm_pending)
+        pa_mainloop_iterate(ml, 1, NULL);
+
+    // And get rid of them all at once
+    for (int i = 0; i < num_sinks; ++i) {
+        if (modules[i] == PA_INVALID_INDEX)
+            continue;
+        pa_operation *oper = pa_context_unload_module(c, modules[i],
+                storm_module_unloaded, NULL);
+        if (oper) {
+            pa_operation_unref(oper);
+            ++storm_pending;
+        }
+    }
+    while (storm_pending)
+        pa_mainloop_iterate(ml, 1, NULL);
+
+    g_free(modules);
+    pa_context_disconnect(c);
+    pa_context_unref(c);
+    pa_mainloop_free(ml);
+    return EXIT_SUCCESS;
+}
+
+static void external_state_cb(pa_context *c, void *data)
+{
+    external_state = pa_context_get_state(c);
+}
+
+static gboolean external_settled(void)
+{
+    return external_state == PA_CONTEXT_READY || external_state == PA_CONTEXT_FAILED;
+}
+
+int main(int argc, char **argv)
+{
+    // We're also the process that generates the event storm
+    if (argc == 3 && !strcmp(argv[1], "--storm"))
+        return run_storm(atoi(argv[2]));
+
+    audio_status_init();
+    pulse_glue_init();
+
+    // Connect another client to change things behind our back
+    pa_glib_mainloop *external_loop = pa_glib_mainloop_new(g_main_context_default());
+    pa_context *external = pa_context_new(pa_glib_mainloop_get_api(external_loop),
+            "pa-applet-bench");
+    pa_context_set_state_callback(external, external_state_cb, NULL);
+    if (pa_context_connect(external, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        g_printerr("Unable to connect the external context\n");
+        return EXIT_FAILURE;
+    }
+
+    // Run all the benchmarks, printing the results as JSON
+    g_print("{\n");
+    g_print("  \"version\": \"%s\",\n", PACKAGE_VERSION);
+    gboolean ok = bench_startup();
+    if (ok && (!run_until(external_settled) || external_state != PA_CONTEXT_READY)) {
+        g_printerr("Failed to connect the external context\n");
+        ok = FALSE;
+    }
+    ok = ok && bench_volume_writes();
+    ok = ok && bench_external_latency(external);
+    ok = ok && bench_peak_meter();
+    ok = ok && bench_allocations();
+    ok = ok && bench_event_storm();
+    g_print("}\n");
+
+    pa_context_disconnect(external);
+    pa_context_unref(external);
+    pa_glib_mainloop_free(external_loop);
+    pulse_glue_destroy();
+    audio_status_destroy();
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,511 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#define SOCKET_NAME "pa-applet.sock"
+#define MAX_COMMAND_LENGTH 1024
+#define SEND_TIMEOUT 2
+
+#include <errno.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <math.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "audio_status.h"
+#include "control_socket.h"
+#include "notifications.h"
+#include "pulse_glue.h"
+
+typedef struct {
+    int fd;
+    guint source_id;
+    GString *input;
+    gboolean monitoring;
+    gboolean dead;
+} client;
+
+static int listen_fd = -1;
+static guint listen_source_id = 0;
+static gchar *socket_path = NULL;
+static GSList *clients = NULL;
+static guint num_monitors = 0;
+
+// The client whose commands are being handled, which can't be freed
+// until its read handler is done with it
+static client *reading_client = NULL;
+
+// The state that was last published to the monitors
+static gboolean published = FALSE;
+static int published_volume;
+static gboolean published_muted;
+static gchar *published_sink = NULL;
+static gchar *published_profile = NULL;
+
+static gboolean make_address(struct sockaddr_un *address)
+{
+    // Figure out where the socket lives
+    gchar *path = g_build_filename(g_get_user_runtime_dir(), SOCKET_NAME, NULL);
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    gboolean fits = strlen(path) < sizeof(address->sun_path);
+    if (fits)
+        strcpy(address->sun_path, path);
+    else
+        g_printerr("The control socket path %s is too long\n", path);
+    g_free(path);
+    return fits;
+}
+
+static void client_destroy(client *cl)
+{
+    // Nothing is published while nobody is listening, so the last state
+    // that was published goes stale with the last monitor
+    if (cl->monitoring && !--num_monitors)
+        published = FALSE;
+    clients = g_slist_remove(clients, cl);
+    g_source_remove(cl->source_id);
+    close(cl->fd);
+    g_string_free(cl->input, TRUE);
+    g_free(cl);
+}
+
+static void drop_client(client *cl)
+{
+    // Leave the client to its read handler if it's running, it'll reap it
+    if (cl == reading_client)
+        cl->dead = TRUE;
+    else
+        client_destroy(cl);
+}
+
+static void reply(client *cl, const gchar *text)
+{
+    // The replies are tiny, so they always fit in the socket buffer
+    if (send(cl->fd, text, strlen(text), MSG_NOSIGNAL) < 0)
+        g_debug("Failed to reply to a control client: %s", g_strerror(errno));
+}
+
+static gboolean parse_number(const gchar *arg, gdouble *value)
+{
+    if (!arg)
+        return FALSE;
+    gchar *end;
+    *value = g_ascii_strtod(arg, &end);
+
+    // NaN and infinity would make their way into the volume level
+    return end != arg && *end == '\0' && isfinite(*value);
+}
+
+static void volume_changed(void)
+{
+    pulse_glue_sync_volume();
+    notifications_flash();
+}
+
+static const gchar *active_profile_name(void)
+{
+    audio_status_profile *profile = audio_status_get_active_profile();
+    return profile ? profile->name : "";
+}
+
+static void reply_state(client *cl)
+{
+    audio_status *as = shared_audio_status();
+    gchar *text = g_strdup_printf("ok volume=%d muted=%s sink=%s profile=%s\n",
+            (int)as->volume, as->muted ? "yes" : "no",
+            pulse_glue_get_default_sink_name(), active_profile_name());
+    reply(cl, text);
+    g_free(text);
+}
+
+static void append_json_string(GString *text, const gchar *value)
+{
+    g_string_append_c(text, '"');
+    for (const gchar *c = value; *c; ++c) {
+        if (*c == '"' || *c == '\\')
+            g_string_append_printf(text, "\\%c", *c);
+        else if ((guchar)*c < 0x20)
+            g_string_append_printf(text, "\\u%04x", (guchar)*c);
+        else
+            g_string_append_c(text, *c);
+    }
+    g_string_append_c(text, '"');
+}
+
+static gchar *format_published_state(void)
+{
+    GString *text = g_string_new(NULL);
+    g_string_append_printf(text, "{\"volume\":%d,\"muted\":%s,\"sink\":",
+            published_volume, published_muted ? "true" : "false");
+    append_json_string(text, published_sink);
+    g_string_append(text, ",\"profile\":");
+    append_json_string(text, published_profile);
+    g_string_append(text, "}\n");
+    return g_string_free(text, FALSE);
+}
+
+static void start_monitoring(client *cl)
+{
+    cl->monitoring = TRUE;
+    ++num_monitors;
+
+    // Tell the new monitor where things stand right away. If other
+    // monitors are listening, what they were told last is current, so
+    // only the new one needs it. Otherwise this is the first publication,
+    // which only reaches the new monitor anyways
+    if (published) {
+        gchar *line = format_published_state();
+        reply(cl, line);
+        g_free(line);
+    }
+    else {
+        control_socket_state_changed();
+    }
+}
+
+static void handle_profile(client *cl, const gchar *name)
+{
+    // Find the profile among the ones of the current card
+    audio_status *as = shared_audio_status();
+    audio_status_profile *profile = name && as->card ?
+        audio_status_card_lookup_profile(as->card, name) : NULL;
+    if (!profile) {
+        reply(cl, "error unknown profile\n");
+        return;
+    }
+
+    // Set it as the only active profile and sync
+    if (!profile->active) {
+        audio_status_set_active_profile(profile);
+        pulse_glue_sync_active_profile();
+    }
+    reply(cl, "ok\n");
+}
+
+static void handle_command(client *cl, gchar *line)
+{
+    // Split the command from its argument
+    gchar *command = g_strstrip(line);
+    gchar *arg = strchr(command, ' ');
+    if (arg) {
+        *arg++ = '\0';
+        arg = g_strstrip(arg);
+    }
+
+    // Monitors are told about the state whenever it changes
+    if (!strcmp(command, "monitor")) {
+        start_monitoring(cl);
+        return;
+    }
+
+    // Querying the state is fine at any time
+    if (!strcmp(command, "get-state")) {
+        if (pulse_glue_get_default_sink_name())
+            reply_state(cl);
+        else
+            reply(cl, "error no default sink\n");
+        return;
+    }
+
+    // Everything else needs a sink
+    if (!pulse_glue_get_default_sink_name()) {
+        reply(cl, "error no default sink\n");
+        return;
+    }
+
+    gdouble value = 1.0;
+    audio_status *as = shared_audio_status();
+    if (!strcmp(command, "raise") || !strcmp(command, "lower")) {
+        if (arg && (!parse_number(arg, &value) || value < 0.0)) {
+            reply(cl, "error invalid number of steps\n");
+            return;
+        }
+        audio_status_step_volume(command[0] == 'r' ? value : -value);
+        volume_changed();
+    }
+    else if (!strcmp(command, "set")) {
+        if (!parse_number(arg, &value)) {
+            reply(cl, "error invalid volume\n");
+            return;
+        }
+        as->volume = CLAMP(value, 0.0, 100.0);
+        volume_changed();
+    }
+    else if (!strcmp(command, "mute")) {
+        gboolean muted;
+        if (!arg || !strcmp(arg, "toggle")) {
+            muted = !as->muted;
+        }
+        else if (!strcmp(arg, "on")) {
+            muted = TRUE;
+        }
+        else if (!strcmp(arg, "off")) {
+            muted = FALSE;
+        }
+        else {
+            reply(cl, "error invalid mute state\n");
+            return;
+        }
+        if (muted != as->muted) {
+            as->muted = muted;
+            pulse_glue_sync_muted();
+            notifications_flash();
+        }
+    }
+    else if (!strcmp(command, "profile")) {
+        handle_profile(cl, arg);
+        return;
+    }
+    else {
+        reply(cl, "error unknown command\n");
+        return;
+    }
+    reply(cl, "ok\n");
+}
+
+static gboolean on_client_readable(gint fd, GIOCondition condition, gpointer data)
+{
+    client *cl = (client *)data;
+
+    // Read whatever is available
+    char buffer[256];
+    ssize_t num_read = recv(fd, buffer, sizeof(buffer), 0);
+    if (num_read < 0 && (errno == EAGAIN || errno == EINTR))
+        return TRUE;
+    if (num_read <= 0) {
+        client_destroy(cl);
+        return FALSE;
+    }
+    g_string_append_len(cl->input, buffer, num_read);
+
+    // Handle every complete line, unless the client is dropped along the
+    // way, e.g. because publishing the state to it failed
+    gchar *newline;
+    reading_client = cl;
+    while ((newline = memchr(cl->input->str, '\n', cl->input->len))) {
+        *newline = '\0';
+        handle_command(cl, cl->input->str);
+        if (cl->dead)
+            break;
+        g_string_erase(cl->input, 0, newline - cl->input->str + 1);
+    }
+    reading_client = NULL;
+    if (cl->dead) {
+        client_destroy(cl);
+        return FALSE;
+    }
+
+    // Don't let misbehaving clients make us buffer forever
+    if (cl->input->len > MAX_COMMAND_LENGTH) {
+        client_destroy(cl);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean on_connection(gint fd, GIOCondition condition, gpointer data)
+{
+    // Accept the connection, it'll be watched just like the listening socket
+    int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            g_printerr("Failed to accept a control connection: %s\n", g_strerror(errno));
+        return TRUE;
+    }
+    client *cl = g_new0(client, 1);
+    cl->fd = client_fd;
+    cl->input = g_string_new(NULL);
+    cl->source_id = g_unix_fd_add(client_fd, G_IO_IN, on_client_readable, cl);
+    clients = g_slist_prepend(clients, cl);
+    return TRUE;
+}
+
+void control_socket_start(void)
+{
+    struct sockaddr_un address;
+    if (!make_address(&address))
+        return;
+
+    // Create the socket
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        g_printerr("Failed to create the control socket: %s\n", g_strerror(errno));
+        return;
+    }
+
+    // Don't steal the socket of another instance, but do get rid of
+    // the ones left behind by instances that are gone
+    int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe_fd >= 0) {
+        gboolean in_use = connect(probe_fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        close(probe_fd);
+        if (in_use) {
+            g_printerr("Another instance is listening on %s\n", address.sun_path);
+            close(listen_fd);
+            listen_fd = -1;
+            return;
+        }
+    }
+    unlink(address.sun_path);
+
+    // Listen, and only for ourselves
+    mode_t old_umask = umask(0077);
+    int result = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    if (result < 0 || listen(listen_fd, 8) < 0) {
+        g_printerr("Failed to listen on %s: %s\n", address.sun_path, g_strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+    socket_path = g_strdup(address.sun_path);
+    listen_source_id = g_unix_fd_add(listen_fd, G_IO_IN, on_connection, NULL);
+}
+
+void control_socket_state_changed(void)
+{
+    // Nothing to do if nobody is listening or there's no state yet
+    const gchar *sink_name = pulse_glue_get_default_sink_name();
+    if (!num_monitors || !sink_name)
+        return;
+
+    // Only publish actual changes
+    audio_status *as = shared_audio_status();
+    const gchar *profile_name = active_profile_name();
+    if (published && published_volume == (int)as->volume && published_muted == as->muted &&
+            !strcmp(published_sink, sink_name) && !strcmp(published_profile, profile_name))
+        return;
+    published = TRUE;
+    published_volume = (int)as->volume;
+    published_muted = as->muted;
+    g_free(published_sink);
+    published_sink = g_strdup(sink_name);
+    g_free(published_profile);
+    published_profile = g_strdup(profile_name);
+
+    // Send the new state to every monitor, dropping the ones that can't
+    // keep up
+    gchar *line = format_published_state();
+    gsize length = strlen(line);
+    GSList *entry = clients;
+    while (entry) {
+        client *cl = (client *)entry->data;
+        entry = g_slist_next(entry);
+        if (cl->monitoring && !cl->dead &&
+                send(cl->fd, line, length, MSG_NOSIGNAL) != (ssize_t)length)
+            drop_client(cl);
+    }
+    g_free(line);
+}
+
+void control_socket_stop(void)
+{
+    while (clients)
+        client_destroy((client *)clients->data);
+    published = FALSE;
+    g_free(published_sink);
+    published_sink = NULL;
+    g_free(published_profile);
+    published_profile = NULL;
+    if (listen_fd >= 0) {
+        g_source_remove(listen_source_id);
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path);
+        g_free(socket_path);
+        socket_path = NULL;
+    }
+}
+
+static int send_command(const gchar *command, gboolean with_timeout)
+{
+    struct sockaddr_un address;
+    if (!make_address(&address))
+        return -1;
+
+    // Connect to the running instance, without waiting for it forever
+    // unless we're expected to
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        g_printerr("Failed to create a socket: %s\n", g_strerror(errno));
+        return -1;
+    }
+    if (with_timeout) {
+        struct timeval timeout = { SEND_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        g_printerr("Failed to connect to %s: %s\n", address.sun_path, g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Send the command
+    gchar *line = g_strconcat(command, "\n", NULL);
+    gboolean ok = send(fd, line, strlen(line), MSG_NOSIGNAL) == (ssize_t)strlen(line);
+    g_free(line);
+    if (!ok) {
+        g_printerr("Failed to send the command: %s\n", g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+gboolean control_socket_send(const gchar *command)
+{
+    // Send the command, and tell the applet that's all we have to say
+    int fd = send_command(command, TRUE);
+    if (fd < 0)
+        return FALSE;
+    shutdown(fd, SHUT_WR);
+
+    // Print the reply, which is a single line
+    GString *text = g_string_new(NULL);
+    char buffer[256];
+    ssize_t num_read;
+    while ((num_read = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        g_string_append_len(text, buffer, num_read);
+    close(fd);
+    if (num_read < 0)
+        g_printerr("Failed to read the reply: %s\n", g_strerror(errno));
+
+    gboolean ok = g_str_has_prefix(text->str, "ok");
+    fputs(text->str, ok ? stdout : stderr);
+    g_string_free(text, TRUE);
+    return ok;
+}
+
+gboolean control_socket_monitor(void)
+{
+    int fd = send_command("monitor", FALSE);
+    if (fd < 0)
+        return FALSE;
+
+    // Pass the state changes along as they come, for as long as the
+    // applet is running
+    char buffer[4096];
+    ssize_t num_read;
+    while ((num_read = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        if (fwrite(buffer, 1, num_read, stdout) != (size_t)num_read || fflush(stdout))
+            break;
+    }
+    close(fd);
+    if (num_read < 0)
+        g_printerr("Failed to read the state: %s\n", g_strerror(errno));
+    else
+        g_printerr("The applet is gone\n");
+    return FALSE;
+}
@@ -0,0 +1,21 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef CONTROL_SOCKET_H
+#define CONTROL_SOCKET_H
+
+#include <glib.h>
+
+void control_socket_start(void);
+void control_socket_stop(void);
+void control_socket_state_changed(void);
+gboolean control_socket_send(const gchar *command);
+gboolean control_socket_monitor(void);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#define EVENT_LOG_HEADER "# pa-applet event log 1"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "event_log.h"
+
+static FILE *record_file = NULL;
+static gint64 record_start;
+
+static gchar **replay_lines = NULL;
+static guint replay_position, replay_records;
+static gboolean replay_max_speed;
+static gint64 replay_start;
+static guint replay_source_id = 0;
+static const event_log_handlers *replay_handlers;
+
+static void schedule_next_record(void);
+
+gboolean event_log_start_recording(const gchar *path)
+{
+    // Open the file, making sure every record hits the disk even if we crash
+    record_file = fopen(path, "w");
+    if (!record_file) {
+        g_printerr("Failed to open %s for recording: %s\n", path, g_strerror(errno));
+        return FALSE;
+    }
+    setvbuf(record_file, NULL, _IOLBF, 0);
+
+    // Timestamps are relative to the start of the recording
+    record_start = g_get_monotonic_time();
+    fprintf(record_file, "%s\n", EVENT_LOG_HEADER);
+    return TRUE;
+}
+
+void event_log_stop_recording(void)
+{
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+gboolean event_log_is_recording(void)
+{
+    return record_file != NULL;
+}
+
+static GString *begin_record(const gchar *kind)
+{
+    GString *line = g_string_new(NULL);
+    g_string_printf(line, "%" G_GINT64_FORMAT "\t%s",
+            g_get_monotonic_time() - record_start, kind);
+    return line;
+}
+
+static void append_uint(GString *line, guint64 value)
+{
+    g_string_append_printf(line, "\t%" G_GUINT64_FORMAT, value);
+}
+
+static void append_string(GString *line, const gchar *value)
+{
+    // Escape the strings so that they don't contain separators
+    gchar *escaped = g_strescape(value ? value : "", NULL);
+    g_string_append_c(line, '\t');
+    g_string_append(line, escaped);
+    g_free(escaped);
+}
+
+static void end_record(GString *line)
+{
+    fprintf(record_file, "%s\n", line->str);
+    g_string_free(line, TRUE);
+}
+
+void event_log_record_event(pa_subscription_event_type_t type, uint32_t idx)
+{
+    GString *line = begin_record("event");
+    append_uint(line, type);
+    append_uint(line, idx);
+    end_record(line);
+}
+
+void event_log_record_server_info(const pa_server_info *info)
+{
+    GString *line = begin_record("server");
+    append_string(line, info->default_sink_name);
+    append_string(line, info->default_source_name);
+    end_record(line);
+}
+
+void event_log_record_sink_info(const pa_sink_info *info)
+{
+    GString *line = begin_record("sink");
+    append_uint(line, info->index);
+    append_uint(line, info->card);
+    append_uint(line, info->monitor_source);
+    append_uint(line, info->volume.channels);
+    append_uint(line, pa_cvolume_avg(&(info->volume)));
+    append_uint(line, info->mute);
+    append_string(line, info->name);
+    append_string(line, info->description);
+    append_string(line, info->monitor_source_name);
+    end_record(line);
+}
+
+void event_log_record_source_info(const pa_source_info *info)
+{
+    GString *line = begin_record("source");
+    append_uint(line, info->index);
+    append_uint(line, info->card);
+    append_uint(line, info->monitor_of_sink);
+    append_uint(line, info->volume.channels);
+    append_uint(line, pa_cvolume_avg(&(info->volume)));
+    append_uint(line, info->mute);
+    append_string(line, info->name);
+    append_string(line, info->description);
+    end_record(line);
+}
+
+void event_log_record_card_info(const pa_card_info *info)
+{
+    // The index of the active profile is recorded, followed by all the
+    // profiles of the card
+    uint32_t active = PA_INVALID_INDEX;
+    for (uint32_t i = 0; i < info->n_profiles; ++i) {
+        if (info->profiles2[i] == info->active_profile2)
+            active = i;
+    }
+
+    GString *line = begin_record("card");
+    append_uint(line, info->index);
+    append_uint(line, active);
+    append_string(line, info->name);
+    append_uint(line, info->n_profiles);
+    for (uint32_t i = 0; i < info->n_profiles; ++i) {
+        append_uint(line, info->profiles2[i]->priority);
+        append_uint(line, info->profiles2[i]->available);
+        append_string(line, info->profiles2[i]->name);
+        append_string(line, info->profiles2[i]->description);
+    }
+    end_record(line);
+}
+
+void event_log_record_sink_input_info(const pa_sink_input_info *info)
+{
+    // Only the application name is recorded out of the properties, it's
+    // the only one we look at
+    GString *line = begin_record("sink_input");
+    append_uint(line, info->index);
+    append_uint(line, info->sink);
+    append_uint(line, info->has_volume);
+    append_uint(line, info->volume_writable);
+    append_uint(line, info->volume.channels);
+    append_uint(line, pa_cvolume_avg(&(info->volume)));
+    append_uint(line, info->mute);
+    append_string(line, info->name);
+    append_string(line, pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME));
+    end_record(line);
+}
+
+static guint64 field_uint(gchar **fields, guint i)
+{
+    return g_ascii_strtoull(fields[i], NULL, 10);
+}
+
+static const gchar *field_string(gchar **fields, guint i, GPtrArray *strings)
+{
+    // The unescaped strings live until the record has been handled
+    gchar *string = g_strcompress(fields[i]);
+    g_ptr_array_add(strings, string);
+    return string;
+}
+
+static const gchar *field_nullable_string(gchar **fields, guint i, GPtrArray *strings)
+{
+    return *fields[i] ? field_string(fields, i, strings) : NULL;
+}
+
+static gboolean field_volume(gchar **fields, guint i, pa_cvolume *volume)
+{
+    guint64 channels = field_uint(fields, i);
+    if (channels < 1 || channels > PA_CHANNELS_MAX)
+        return FALSE;
+    pa_cvolume_init(volume);
+    pa_cvolume_set(volume, channels, field_uint(fields, i + 1));
+    return TRUE;
+}
+
+static gboolean replay_card(gchar **fields, guint num_fields, GPtrArray *strings)
+{
+    // Check that we have all the profiles
+    if (num_fields < 6)
+        return FALSE;
+    guint64 num_profiles = field_uint(fields, 5);
+    if (num_fields != 6 + num_profiles * 4)
+        return FALSE;
+
+    // Rebuild the profiles
+    pa_card_profile_info2 *profiles = g_new0(pa_card_profile_info2, num_profiles + 1);
+    pa_card_profile_info2 **profiles2 = g_new0(pa_card_profile_info2 *, num_profiles + 1);
+    for (guint i = 0; i < num_profiles; ++i) {
+        guint base = 6 + i * 4;
+        profiles[i].priority = field_uint(fields, base);
+        profiles[i].available = field_uint(fields, base + 1);
+        profiles[i].name = field_string(fields, base + 2, strings);
+        profiles[i].description = field_string(fields, base + 3, strings);
+        profiles2[i] = &profiles[i];
+    }
+
+    // And the card itself
+    pa_card_info info;
+    memset(&info, 0, sizeof(info));
+    info.index = field_uint(fields, 2);
+    info.name = field_string(fields, 4, strings);
+    info.n_profiles = num_profiles;
+    info.profiles2 = profiles2;
+    guint64 active = field_uint(fields, 3);
+    info.active_profile2 = active < num_profiles ? profiles2[active] : NULL;
+    replay_handlers->card_info(&info);
+
+    g_free(profiles2);
+    g_free(profiles);
+    return TRUE;
+}
+
+static gboolean replay_record(gchar **fields)
+{
+    guint num_fields = g_strv_length(fields);
+    if (num_fields < 2)
+        return FALSE;
+
+    const gchar *kind = fields[1];
+    gboolean ok = TRUE;
+    GPtrArray *strings = g_ptr_array_new_with_free_func(g_free);
+
+    if (!strcmp(kind, "event") && num_fields == 4) {
+        replay_handlers->event(field_uint(fields, 2), field_uint(fields, 3));
+    }
+    else if (!strcmp(kind, "server") && num_fields == 4) {
+        pa_server_info info;
+        memset(&info, 0, sizeof(info));
+        info.default_sink_name = field_nullable_string(fields, 2, strings);
+        info.default_source_name = field_nullable_string(fields, 3, strings);
+        replay_handlers->server_info(&info);
+    }
+    else if (!strcmp(kind, "sink") && num_fields == 11) {
+        pa_sink_info info;
+        memset(&info, 0, sizeof(info));
+        info.index = field_uint(fields, 2);
+        info.card = field_uint(fields, 3);
+        info.monitor_source = field_uint(fields, 4);
+        ok = field_volume(fields, 5, &info.volume);
+        info.mute = field_uint(fields, 7);
+        info.name = field_string(fields, 8, strings);
+        info.description = field_string(fields, 9, strings);
+        info.monitor_source_name = field_nullable_string(fields, 10, strings);
+        if (ok)
+            replay_handlers->sink_info(&info);
+    }
+    else if (!strcmp(kind, "source") && num_fields == 10) {
+        pa_source_info info;
+        memset(&info, 0, sizeof(info));
+        info.index = field_uint(fields, 2);
+        info.card = field_uint(fields, 3);
+        info.monitor_of_sink = field_uint(fields, 4);
+        ok = field_volume(fields, 5, &info.volume);
+        info.mute = field_uint(fields, 7);
+        info.name = field_string(fields, 8, strings);
+        info.description = field_string(fields, 9, strings);
+        if (ok)
+            replay_handlers->source_info(&info);
+    }
+    else if (!strcmp(kind, "card")) {
+        ok = replay_card(fields, num_fields, strings);
+    }
+    else if (!strcmp(kind, "sink_input") && num_fields == 11) {
+        pa_sink_input_info info;
+        memset(&info, 0, sizeof(info));
+        info.index = field_uint(fields, 2);
+        info.sink = field_uint(fields, 3);
+        info.has_volume = field_uint(fields, 4);
+        info.volume_writable = field_uint(fields, 5);
+        ok = field_volume(fields, 6, &info.volume);
+        info.mute = field_uint(fields, 8);
+        info.name = field_string(fields, 9, strings);
+        info.proplist = pa_proplist_new();
+        const gchar *application_name = field_nullable_string(fields, 10, strings);
+        if (application_name)
+            pa_proplist_sets(info.proplist, PA_PROP_APPLICATION_NAME, application_name);
+        if (ok)
+            replay_handlers->sink_input_info(&info);
+        pa_proplist_free(info.proplist);
+    }
+    else {
+        ok = FALSE;
+    }
+
+    g_ptr_array_free(strings, TRUE);
+    return ok;
+}
+
+static gboolean replay_next_record(gpointer data)
+{
+    replay_source_id = 0;
+
+    // Feed the record to the handlers
+    gchar **fields = g_strsplit(replay_lines[replay_position++], "\t", -1);
+    if (replay_record(fields))
+        ++replay_records;
+    else
+        g_printerr("Ignoring malformed event log record on line %u\n", replay_position);
+    g_strfreev(fields);
+
+    schedule_next_record();
+    return FALSE;
+}
+
+static gboolean start_replay(gpointer data)
+{
+    // The timestamps are relative to now, the startup doesn't count
+    replay_source_id = 0;
+    replay_start = g_get_monotonic_time();
+    schedule_next_record();
+    return FALSE;
+}
+
+static void schedule_next_record(void)
+{
+    // Skip blank lines and comments
+    while (replay_lines[replay_position] &&
+            (!*replay_lines[replay_position] || *replay_lines[replay_position] == '#'))
+        ++replay_position;
+
+    // Check if we're done
+    if (!replay_lines[replay_position]) {
+        gint64 elapsed = g_get_monotonic_time() - replay_start;
+        g_strfreev(replay_lines);
+        replay_lines = NULL;
+        replay_handlers->finished(replay_records, elapsed);
+        return;
+    }
+
+    // At maximum speed, only let the main loop run in between records
+    if (replay_max_speed) {
+        replay_source_id = g_idle_add(replay_next_record, NULL);
+        return;
+    }
+
+    // Otherwise wait until it's time for the next record
+    gint64 timestamp = g_ascii_strtoll(replay_lines[replay_position], NULL, 10);
+    gint64 delay = replay_start + timestamp - g_get_monotonic_time();
+    replay_source_id = g_timeout_add(delay > 0 ? delay / 1000 : 0,
+            replay_next_record, NULL);
+}
+
+gboolean event_log_start_replay(const gchar *path, gboolean max_speed,
+        const event_log_handlers *handlers)
+{
+    // Read the whole recording
+    gchar *contents;
+    GError *error = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, &error)) {
+        g_printerr("Failed to read %s: %s\n", path, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    replay_lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    // Make sure this is really an event log
+    if (!replay_lines[0] || strcmp(replay_lines[0], EVENT_LOG_HEADER)) {
+        g_printerr("%s is not a pa-applet event log\n", path);
+        g_strfreev(replay_lines);
+        replay_lines = NULL;
+        return FALSE;
+    }
+
+    // Start feeding the records
+    replay_position = 1;
+    replay_records = 0;
+    replay_max_speed = max_speed;
+    replay_handlers = handlers;
+
+    // Wait for the main loop, the handlers may want to quit it, even if
+    // the recording turns out to be empty
+    replay_source_id = g_idle_add(start_replay, NULL);
+    return TRUE;
+}
+
+void event_log_stop_replay(void)
+{
+    if (replay_source_id) {
+        g_source_remove(replay_source_id);
+        replay_source_id = 0;
+    }
+    if (replay_lines) {
+        g_strfreev(replay_lines);
+        replay_lines = NULL;
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+typedef struct {
+    void (*event)(pa_subscription_event_type_t type, uint32_t idx);
+    void (*server_info)(const pa_server_info *info);
+    void (*sink_info)(const pa_sink_info *info);
+    void (*source_info)(const pa_source_info *info);
+    void (*card_info)(const pa_card_info *info);
+    void (*sink_input_info)(const pa_sink_input_info *info);
+    void (*finished)(guint num_records, gint64 elapsed);
+} event_log_handlers;
+
+gboolean event_log_start_recording(const gchar *path);
+void event_log_stop_recording(void);
+gboolean event_log_is_recording(void);
+void event_log_record_event(pa_subscription_event_type_t type, uint32_t idx);
+void event_log_record_server_info(const pa_server_info *info);
+void event_log_record_sink_info(const pa_sink_info *info);
+void event_log_record_source_info(const pa_source_info *info);
+void event_log_record_card_info(const pa_card_info *info);
+void event_log_record_sink_input_info(const pa_sink_input_info *info);
+
+gboolean event_log_start_replay(const gchar *path, gboolean max_speed,
+        const event_log_handlers *handlers);
+void event_log_stop_replay(void);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#include <glib.h>
+
+#include "idle_trigger.h"
+
+// These work like g_idle_add(), except that the source is created once
+// and stays attached, so firing it over and over doesn't allocate anything
+
+static gboolean dispatch(GSource *source, GSourceFunc callback, gpointer data)
+{
+    // Disarm first, so that the callback can fire the trigger again
+    g_source_set_ready_time(source, -1);
+    if (callback)
+        callback(data);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs trigger_funcs = {
+    NULL,
+    NULL,
+    dispatch,
+    NULL
+};
+
+GSource *idle_trigger_new(gint priority, GSourceFunc func)
+{
+    GSource *trigger = g_source_new(&trigger_funcs, sizeof(GSource));
+    g_source_set_priority(trigger, priority);
+    g_source_set_callback(trigger, func, NULL, NULL);
+    g_source_set_ready_time(trigger, -1);
+    g_source_attach(trigger, NULL);
+    return trigger;
+}
+
+void idle_trigger_destroy(GSource *trigger)
+{
+    g_source_destroy(trigger);
+    g_source_unref(trigger);
+}
+
+void idle_trigger_fire(GSource *trigger)
+{
+    // Dispatch in the next main loop iteration, if nothing more
+    // important is pending
+    g_source_set_ready_time(trigger, 0);
+}
+
+void idle_trigger_cancel(GSource *trigger)
+{
+    g_source_set_ready_time(trigger, -1);
+}
+
+gboolean idle_trigger_is_pending(GSource *trigger)
+{
+    return g_source_get_ready_time(trigger) != -1;
+}
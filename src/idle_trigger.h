@@ -0,0 +1,21 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef IDLE_TRIGGER_H
+#define IDLE_TRIGGER_H
+
+#include <glib.h>
+
+GSource *idle_trigger_new(gint priority, GSourceFunc func);
+void idle_trigger_destroy(GSource *trigger);
+void idle_trigger_fire(GSource *trigger);
+void idle_trigger_cancel(GSource *trigger);
+gboolean idle_trigger_is_pending(GSource *trigger);
+
+#endif
@@ -9,43 +9,184 @@
 
 #include <gdk/gdkx.h>
 #include <gtk/gtk.h>
+#include <math.h>
+#include <string.h>
 #include <X11/Xlib.h>
+#include <X11/XKBlib.h>
 
+#include "idle_trigger.h"
 #include "key_grabber.h"
+#include "trace.h"
 
-#define NUM_KEYS_TO_GRAB 3
+// How long a key has to be held before repeats start to accelerate, how
+// long it takes for them to be worth one more step, and how many steps
+// a single repeat can be worth at most (all times in milliseconds)
+#define ACCELERATION_DELAY 400
+#define ACCELERATION_PERIOD 800
+#define MAX_STEPS_PER_REPEAT 4.0
 
-static key_grabber_cb volume_raise_cb = NULL;
-static key_grabber_cb volume_lower_cb = NULL;
-static key_grabber_cb volume_mute_cb = NULL;
+// A keysym is rarely found on more than a couple of keys
+#define MAX_KEYCODES_PER_BINDING 4
+#define NUM_KEYCODES 256
 
-static key_grabber_cb *grabbers[NUM_KEYS_TO_GRAB] = {
-    &volume_raise_cb,
-    &volume_lower_cb,
-    &volume_mute_cb
+// The modifiers that can be part of a binding
+#define BINDING_MODIFIERS (ShiftMask | ControlMask | Mod1Mask | Mod4Mask)
+
+typedef struct {
+    gchar *spec;
+    guint keyval;
+    guint modifiers;
+    key_grabber_action action;
+    gdouble steps;
+
+    // The keys that produce the keysym with the current keymap
+    KeyCode keycodes[MAX_KEYCODES_PER_BINDING];
+    guint num_keycodes;
+    gboolean grab_failed;
+
+    // State of the key, used to tell autorepeats from actual presses
+    gboolean held;
+    Time press_time;
+    Time release_time;
+} binding;
+
+typedef struct {
+    unsigned long serial;
+    binding *b;
+} grab_request;
+
+// The combinations of modifiers that are grabbed along with each binding
+// so that they don't get in the way (Num Lock, Scroll Lock and Caps Lock)
+static const guint ignored_modifiers[] = {
+    0,
+    Mod2Mask,
+    Mod5Mask,
+    LockMask,
+    Mod2Mask | Mod5Mask,
+    Mod2Mask | LockMask,
+    Mod5Mask | LockMask,
+    Mod2Mask | Mod5Mask | LockMask
+};
+
+static const gchar *action_names[KEY_GRABBER_NUM_ACTIONS] = {
+    "raise",
+    "lower",
+    "mute",
+    "mic-mute"
 };
 
-static const char *keysym_names[NUM_KEYS_TO_GRAB] = {
-    "XF86AudioRaiseVolume",
-    "XF86AudioLowerVolume",
-    "XF86AudioMute"
+static const gchar *default_bindings[] = {
+    "XF86AudioRaiseVolume=raise",
+    "XF86AudioLowerVolume=lower",
+    "XF86AudioMute=mute",
+    "XF86AudioMicMute=mic-mute"
 };
 
-static KeyCode grabbed_keys[NUM_KEYS_TO_GRAB] = { 0, };
+static key_grabber_cb callbacks[KEY_GRABBER_NUM_ACTIONS] = { NULL, };
+
+static GPtrArray *bindings = NULL;
+static gboolean grabbed = FALSE;
+
+// The bindings of each keycode, so that events are dispatched without
+// looking at the bindings of other keys
+static GSList *keycode_bindings[NUM_KEYCODES] = { NULL, };
+
+// The grab requests that were sent and haven't been checked for errors yet,
+// and the X error handler that gets the errors that aren't about them
+static GArray *grab_requests = NULL;
+static XErrorHandler previous_error_handler = NULL;
+
+// Presses that haven't been dispatched yet
+static gdouble pending_steps[KEY_GRABBER_NUM_ACTIONS] = { 0.0, };
+static GSource *dispatch_trigger = NULL;
+
+static gulong keys_changed_id = 0;
+
+static gboolean dispatch_presses(gpointer data)
+{
+    gint64 begin = trace_begin();
+
+    // Collapse the volume keys into a single net step
+    gdouble steps = pending_steps[KEY_GRABBER_VOLUME_RAISE] -
+        pending_steps[KEY_GRABBER_VOLUME_LOWER];
+    if (steps > 0.0 && callbacks[KEY_GRABBER_VOLUME_RAISE])
+        callbacks[KEY_GRABBER_VOLUME_RAISE](steps);
+    else if (steps < 0.0 && callbacks[KEY_GRABBER_VOLUME_LOWER])
+        callbacks[KEY_GRABBER_VOLUME_LOWER](-steps);
+
+    // Pressing mute twice is the same as not pressing it at all
+    if (((int)pending_steps[KEY_GRABBER_VOLUME_MUTE]) % 2 && callbacks[KEY_GRABBER_VOLUME_MUTE])
+        callbacks[KEY_GRABBER_VOLUME_MUTE](1.0);
+    if (((int)pending_steps[KEY_GRABBER_MIC_MUTE]) % 2 && callbacks[KEY_GRABBER_MIC_MUTE])
+        callbacks[KEY_GRABBER_MIC_MUTE](1.0);
+
+    for (int i = 0; i < KEY_GRABBER_NUM_ACTIONS; ++i)
+        pending_steps[i] = 0.0;
+    trace_end("input", "key_dispatch", begin);
+    return FALSE;
+}
+
+static void handle_key_press(binding *b, XKeyEvent *keyevent)
+{
+    // With detectable autorepeat, repeats are presses of a key that's
+    // already held. Otherwise they're presses with the same timestamp
+    // as the release that came right before them
+    gboolean repeat = b->held || keyevent->time == b->release_time;
+    if (!repeat)
+        b->press_time = keyevent->time;
+    b->held = TRUE;
+
+    // Toggling the mute switches over and over isn't useful
+    gdouble steps = 1.0;
+    if (repeat) {
+        if (b->action == KEY_GRABBER_VOLUME_MUTE || b->action == KEY_GRABBER_MIC_MUTE)
+            return;
+
+        // Speed up the longer the key is held
+        Time held_time = keyevent->time - b->press_time;
+        if (held_time > ACCELERATION_DELAY) {
+            steps += (gdouble)(held_time - ACCELERATION_DELAY) / ACCELERATION_PERIOD;
+            if (steps > MAX_STEPS_PER_REPEAT)
+                steps = MAX_STEPS_PER_REPEAT;
+        }
+    }
+
+    key_grabber_queue_press(b->action, steps * b->steps);
+}
 
 static GdkFilterReturn filter_func(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data)
 {
-    // Skip events other than key presses
+    // Skip events other than key presses and releases
     XEvent *xevent = (XEvent *)gdk_xevent;
-    if (xevent->type != KeyPress)
+    if (xevent->type != KeyPress && xevent->type != KeyRelease)
         return GDK_FILTER_CONTINUE;
 
-    // Find a match for the key press
+    // Only look at the bindings of this key
     XKeyEvent *keyevent = (XKeyEvent *)xevent;
-    for (int i = 0; i < NUM_KEYS_TO_GRAB; ++i) {
-        if (keyevent->keycode == grabbed_keys[i]) {
-            if (grabbers[i] != NULL)
-                (*grabbers[i])();
+    GSList *entry = keyevent->keycode < NUM_KEYCODES ?
+        keycode_bindings[keyevent->keycode] : NULL;
+    if (!entry)
+        return GDK_FILTER_CONTINUE;
+
+    // The modifiers might have been released before the key, so a
+    // release counts for all the bindings of the key
+    if (xevent->type == KeyRelease) {
+        for (; entry; entry = g_slist_next(entry)) {
+            binding *b = (binding *)entry->data;
+            b->held = FALSE;
+            b->release_time = keyevent->time;
+        }
+        return GDK_FILTER_REMOVE;
+    }
+
+    // Find the binding with the same modifiers
+    guint modifiers = keyevent->state & BINDING_MODIFIERS;
+    for (; entry; entry = g_slist_next(entry)) {
+        binding *b = (binding *)entry->data;
+        if (b->modifiers == modifiers) {
+            gint64 begin = trace_begin();
+            handle_key_press(b, keyevent);
+            trace_end("input", "key_press", begin);
             return GDK_FILTER_REMOVE;
         }
     }
@@ -54,75 +195,169 @@ static GdkFilterReturn filter_func(GdkXEvent *gdk_xevent, GdkEvent *event, gpoin
     return GDK_FILTER_CONTINUE;
 }
 
-void key_grabber_grab_keys(void)
+static binding *find_binding(guint keyval, guint modifiers)
 {
-    // Find the X11 display
-    GdkDisplay *gdkDisplay = gdk_display_get_default();
-    Display *dpy = GDK_DISPLAY_XDISPLAY(gdkDisplay);
+    for (guint i = 0; bindings && i < bindings->len; ++i) {
+        binding *b = (binding *)g_ptr_array_index(bindings, i);
+        if (b->keyval == keyval && b->modifiers == modifiers)
+            return b;
+    }
+    return NULL;
+}
+
+static void binding_destroy(gpointer data)
+{
+    binding *b = (binding *)data;
+    g_free(b->spec);
+    g_free(b);
+}
 
-    // Resolve the keysym names into keycodes
-    for (int i = 0; i < NUM_KEYS_TO_GRAB; ++i) {
-        // Resolve the keysym name into a keysym first
-        KeySym keysym = XStringToKeysym(keysym_names[i]);
-        if (keysym == NoSymbol) {
-            g_printerr("Failed to resolve %s into a keysym\n", keysym_names[i]);
-            continue;
+gboolean key_grabber_add_binding(const gchar *spec)
+{
+    // Split the binding into the accelerator, the action and the steps,
+    // e.g. "<Shift>XF86AudioRaiseVolume=raise:0.2"
+    const gchar *equals = strrchr(spec, '=');
+    if (!equals) {
+        g_printerr("Invalid key binding %s\n", spec);
+        return FALSE;
+    }
+    gchar *accelerator = g_strndup(spec, equals - spec);
+    const gchar *action_name = equals + 1;
+    const gchar *colon = strchr(action_name, ':');
+    gsize action_length = colon ? (gsize)(colon - action_name) : strlen(action_name);
+
+    // Parse the accelerator in the GTK+ syntax
+    guint keyval;
+    GdkModifierType gdk_modifiers;
+    gtk_accelerator_parse(accelerator, &keyval, &gdk_modifiers);
+    g_free(accelerator);
+    if (!keyval || (gdk_modifiers & GDK_MODIFIER_MASK & ~BINDING_MODIFIERS & ~GDK_SUPER_MASK)) {
+        g_printerr("Invalid key in binding %s\n", spec);
+        return FALSE;
+    }
+
+    // Find the action
+    int action = -1;
+    for (int i = 0; i < KEY_GRABBER_NUM_ACTIONS; ++i) {
+        if (strlen(action_names[i]) == action_length &&
+                !strncmp(action_names[i], action_name, action_length)) {
+            action = i;
+            break;
         }
+    }
+    if (action < 0) {
+        g_printerr("Invalid action in key binding %s\n", spec);
+        return FALSE;
+    }
 
-        // Resolve the keysym into a keycode
-        grabbed_keys[i] = XKeysymToKeycode(dpy, keysym);
-        if (grabbed_keys[i] == 0) {
-            g_printerr("Failed to resolve %s into a keycode\n", keysym_names[i]);
-            continue;
+    // And the steps, which only make sense for the volume keys
+    gdouble steps = 1.0;
+    if (colon) {
+        gchar *end;
+        steps = g_ascii_strtod(colon + 1, &end);
+        if (*end || !isfinite(steps) || steps <= 0.0 || (action != KEY_GRABBER_VOLUME_RAISE &&
+                    action != KEY_GRABBER_VOLUME_LOWER)) {
+            g_printerr("Invalid steps in key binding %s\n", spec);
+            return FALSE;
         }
     }
 
-    int numScreens = 1;
-#if GDK_VERSION_CUR_STABLE < G_ENCODE_VERSION(3, 10)
-    numScreens = gdk_display_get_n_screens(gdkDisplay);
-#endif
+    // Super is the only virtual modifier we accept, and it's always Mod4
+    guint modifiers = gdk_modifiers & BINDING_MODIFIERS;
+    if (gdk_modifiers & GDK_SUPER_MASK)
+        modifiers |= Mod4Mask;
 
-    // Grab the keys for all screens
-    for (int i = 0; i < numScreens; ++i) {
-        GdkScreen *screen = gdk_display_get_screen(gdkDisplay, i);
-        if (screen == NULL)
-            continue;
+    // A binding for the same keys replaces the previous one
+    binding *b = find_binding(keyval, modifiers);
+    if (!b) {
+        if (!bindings)
+            bindings = g_ptr_array_new_with_free_func(binding_destroy);
+        b = g_malloc0(sizeof(binding));
+        b->keyval = keyval;
+        b->modifiers = modifiers;
+        g_ptr_array_add(bindings, b);
+    }
+    g_free(b->spec);
+    b->spec = g_strndup(spec, equals - spec);
+    b->action = action;
+    b->steps = steps;
+    return TRUE;
+}
 
-        // Find the X11 root window
-        GdkWindow *gdkRoot = gdk_screen_get_root_window(screen);
-        Window root = GDK_WINDOW_XID(gdkRoot);
+void key_grabber_add_default_bindings(void)
+{
+    for (gsize i = 0; i < G_N_ELEMENTS(default_bindings); ++i)
+        key_grabber_add_binding(default_bindings[i]);
+}
 
-        for (int i = 0; i < NUM_KEYS_TO_GRAB; ++i) {
-            // Ignore the keys that we couldn't resolve
-            KeyCode keycode = grabbed_keys[i];
-            if (keycode == 0)
-                continue;
+void key_grabber_remove_bindings(void)
+{
+    if (bindings) {
+        g_ptr_array_free(bindings, TRUE);
+        bindings = NULL;
+    }
+}
+
+static void resolve_keycodes(void)
+{
+    // Forget about the previous keymap
+    for (guint i = 0; i < NUM_KEYCODES; ++i) {
+        g_slist_free(keycode_bindings[i]);
+        keycode_bindings[i] = NULL;
+    }
+
+    // Find the keys that produce each keysym, without any modifiers
+    GdkKeymap *keymap = gdk_keymap_get_default();
+    for (guint i = 0; i < bindings->len; ++i) {
+        binding *b = (binding *)g_ptr_array_index(bindings, i);
+        b->num_keycodes = 0;
+        b->grab_failed = FALSE;
+        b->held = FALSE;
 
-            // Try to grab the keycodes with any modifiers
-            gdk_error_trap_push();
-            XGrabKey(dpy, keycode, 0, root, True, GrabModeAsync, GrabModeAsync);
-            XGrabKey(dpy, keycode, Mod2Mask, root, True, GrabModeAsync, GrabModeAsync);
-            XGrabKey(dpy, keycode, Mod5Mask, root, True, GrabModeAsync, GrabModeAsync);
-            XGrabKey(dpy, keycode, LockMask, root, True, GrabModeAsync, GrabModeAsync);
-            XGrabKey(dpy, keycode, Mod2Mask | Mod5Mask, root, True, GrabModeAsync, GrabModeAsync);
-            XGrabKey(dpy, keycode, Mod2Mask | LockMask, root, True, GrabModeAsync, GrabModeAsync);
-            XGrabKey(dpy, keycode, Mod5Mask | LockMask, root, True, GrabModeAsync, GrabModeAsync);
-            XGrabKey(dpy, keycode, Mod2Mask | Mod5Mask | LockMask, root, True, GrabModeAsync, GrabModeAsync);
-            gdk_flush();
-
-            // Handle errors
-            if (gdk_error_trap_pop())
-                g_printerr("Failed to grab %s\n", keysym_names[i]);
+        GdkKeymapKey *keys;
+        gint num_keys;
+        if (gdk_keymap_get_entries_for_keyval(keymap, b->keyval, &keys, &num_keys)) {
+            for (gint j = 0; j < num_keys; ++j) {
+                KeyCode keycode = keys[j].keycode;
+                if (keys[j].level != 0 || keys[j].keycode >= NUM_KEYCODES ||
+                        b->num_keycodes == MAX_KEYCODES_PER_BINDING)
+                    continue;
+                b->keycodes[b->num_keycodes++] = keycode;
+                if (!g_slist_find(keycode_bindings[keycode], b))
+                    keycode_bindings[keycode] = g_slist_prepend(keycode_bindings[keycode], b);
+            }
+            g_free(keys);
         }
+        if (!b->num_keycodes)
+            g_debug("%s isn't on the keyboard", b->spec);
+    }
+}
 
-        // Register for X events
-        gdk_window_add_filter(gdkRoot, filter_func, NULL);
+static int on_grab_error(Display *dpy, XErrorEvent *error)
+{
+    // A key that's grabbed by another client fails with BadAccess. Tell
+    // which binding the failed request was for, just once
+    if (error->error_code == BadAccess) {
+        for (guint i = 0; i < grab_requests->len; ++i) {
+            grab_request *request = &g_array_index(grab_requests, grab_request, i);
+            if (request->serial != error->serial)
+                continue;
+            if (!request->b->grab_failed) {
+                gchar text[128];
+                XGetErrorText(dpy, error->error_code, text, sizeof(text));
+                g_printerr("Failed to grab %s: %s\n", request->b->spec, text);
+                request->b->grab_failed = TRUE;
+            }
+            return 0;
+        }
     }
+
+    // Anything else isn't ours to swallow
+    return previous_error_handler ? previous_error_handler(dpy, error) : 0;
 }
 
-void key_grabber_ungrab_keys(void)
+static void for_each_root_window(void (*func)(Display *, Window))
 {
-    // Find the X11 display
     GdkDisplay *gdkDisplay = gdk_display_get_default();
     Display *dpy = GDK_DISPLAY_XDISPLAY(gdkDisplay);
 
@@ -131,52 +366,134 @@ void key_grabber_ungrab_keys(void)
     numScreens = gdk_display_get_n_screens(gdkDisplay);
 #endif
 
-    // Ungrab the keys for all screens
     for (int i = 0; i < numScreens; ++i) {
         GdkScreen *screen = gdk_display_get_screen(gdkDisplay, i);
-        if (screen == NULL)
-            continue;
-
-        // Find the X11 root window
-        GdkWindow *gdkRoot = gdk_screen_get_root_window(screen);
-        Window root = GDK_WINDOW_XID(gdkRoot);
-
-        for (int i = 0; i < NUM_KEYS_TO_GRAB; ++i) {
-            // Ignore the keys that we couldn't resolve
-            KeyCode keycode = grabbed_keys[i];
-            if (keycode == 0)
-                continue;
+        if (screen != NULL)
+            func(dpy, GDK_WINDOW_XID(gdk_screen_get_root_window(screen)));
+    }
+}
 
-            // Ungrab everything
-            gdk_error_trap_push();
-            XUngrabKey(dpy, keycode, Mod2Mask, root);
-            XUngrabKey(dpy, keycode, Mod5Mask, root);
-            XUngrabKey(dpy, keycode, LockMask, root);
-            XUngrabKey(dpy, keycode, Mod2Mask | Mod5Mask, root);
-            XUngrabKey(dpy, keycode, Mod2Mask | LockMask, root);
-            XUngrabKey(dpy, keycode, Mod5Mask | LockMask, root);
-            XUngrabKey(dpy, keycode, Mod2Mask | Mod5Mask | LockMask, root);
-            gdk_flush();
-            if (gdk_error_trap_pop())
-                g_printerr("Failed to ungrab %s\n", keysym_names[i]);
+static void grab_root_window(Display *dpy, Window root)
+{
+    // Queue the grabs of every binding, with every combination of the
+    // modifiers we ignore, taking note of the request serials
+    for (guint i = 0; i < bindings->len; ++i) {
+        binding *b = (binding *)g_ptr_array_index(bindings, i);
+        for (guint j = 0; j < b->num_keycodes; ++j) {
+            for (gsize k = 0; k < G_N_ELEMENTS(ignored_modifiers); ++k) {
+                grab_request request = { NextRequest(dpy), b };
+                g_array_append_val(grab_requests, request);
+                XGrabKey(dpy, b->keycodes[j], b->modifiers | ignored_modifiers[k],
+                        root, True, GrabModeAsync, GrabModeAsync);
+            }
         }
+    }
+}
 
-        // Unregister for X events
-        gdk_window_remove_filter(gdkRoot, filter_func, NULL);
+static void ungrab_root_window(Display *dpy, Window root)
+{
+    for (guint i = 0; i < bindings->len; ++i) {
+        binding *b = (binding *)g_ptr_array_index(bindings, i);
+        for (guint j = 0; j < b->num_keycodes; ++j) {
+            for (gsize k = 0; k < G_N_ELEMENTS(ignored_modifiers); ++k)
+                XUngrabKey(dpy, b->keycodes[j], b->modifiers | ignored_modifiers[k], root);
+        }
     }
 }
 
-void key_grabber_register_volume_raise_callback(key_grabber_cb cb)
+static void grab_all(void)
+{
+    // Send all the grabs in one go and wait for the server just once. The
+    // errors are matched to the bindings by their request serials
+    Display *dpy = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+    grab_requests = g_array_new(FALSE, FALSE, sizeof(grab_request));
+    gdk_flush();
+    previous_error_handler = XSetErrorHandler(on_grab_error);
+    for_each_root_window(grab_root_window);
+    XSync(dpy, False);
+    XSetErrorHandler(previous_error_handler);
+    previous_error_handler = NULL;
+    g_array_free(grab_requests, TRUE);
+    grab_requests = NULL;
+}
+
+static void ungrab_all(void)
+{
+    // Failing to ungrab is harmless, so don't wait for the server at all
+    gdk_error_trap_push();
+    for_each_root_window(ungrab_root_window);
+    gdk_error_trap_pop_ignored();
+}
+
+static void on_keys_changed(GdkKeymap *keymap, gpointer data)
+{
+    // The keyboard was plugged or the layout changed, so the keysyms
+    // might be on different keys now
+    g_debug("The keymap changed, grabbing the keys again");
+    ungrab_all();
+    resolve_keycodes();
+    grab_all();
+}
+
+void key_grabber_grab_keys(void)
 {
-    volume_raise_cb = cb;
+    // Nothing to do without bindings
+    if (!bindings || grabbed)
+        return;
+
+    // Ask for autorepeats without the fake releases in between, if possible
+    Display *dpy = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+    Bool detectable_autorepeat;
+    XkbSetDetectableAutoRepeat(dpy, True, &detectable_autorepeat);
+    if (!detectable_autorepeat)
+        g_debug("Detectable autorepeat isn't supported");
+
+    // Grab the keys for all screens
+    resolve_keycodes();
+    grab_all();
+    grabbed = TRUE;
+
+    // Register for X events, and for changes of the keymap
+    gdk_window_add_filter(NULL, filter_func, NULL);
+    keys_changed_id = g_signal_connect(gdk_keymap_get_default(), "keys-changed",
+            G_CALLBACK(on_keys_changed), NULL);
+}
+
+void key_grabber_ungrab_keys(void)
+{
+    if (!grabbed)
+        return;
+
+    // Ungrab everything and unregister for X events
+    g_signal_handler_disconnect(gdk_keymap_get_default(), keys_changed_id);
+    gdk_window_remove_filter(NULL, filter_func, NULL);
+    ungrab_all();
+    gdk_flush();
+    for (guint i = 0; i < NUM_KEYCODES; ++i) {
+        g_slist_free(keycode_bindings[i]);
+        keycode_bindings[i] = NULL;
+    }
+    grabbed = FALSE;
+
+    // Forget about the presses we haven't dispatched yet
+    if (dispatch_trigger) {
+        idle_trigger_destroy(dispatch_trigger);
+        dispatch_trigger = NULL;
+    }
+    for (int i = 0; i < KEY_GRABBER_NUM_ACTIONS; ++i)
+        pending_steps[i] = 0.0;
 }
 
-void key_grabber_register_volume_lower_callback(key_grabber_cb cb)
+void key_grabber_register_callback(key_grabber_action action, key_grabber_cb cb)
 {
-    volume_lower_cb = cb;
+    callbacks[action] = cb;
 }
 
-void key_grabber_register_volume_mute_callback(key_grabber_cb cb)
+void key_grabber_queue_press(key_grabber_action action, gdouble steps)
 {
-    volume_mute_cb = cb;
+    // Dispatch all the presses of this main loop iteration at once
+    pending_steps[action] += steps;
+    if (!dispatch_trigger)
+        dispatch_trigger = idle_trigger_new(G_PRIORITY_HIGH_IDLE, dispatch_presses);
+    idle_trigger_fire(dispatch_trigger);
 }
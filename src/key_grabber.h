@@ -10,12 +10,24 @@
 #ifndef KEY_GRABBER_H
 #define KEY_GRABBER_H
 
-typedef void (*key_grabber_cb)(void);
+#include <glib.h>
 
+typedef enum {
+    KEY_GRABBER_VOLUME_RAISE,
+    KEY_GRABBER_VOLUME_LOWER,
+    KEY_GRABBER_VOLUME_MUTE,
+    KEY_GRABBER_MIC_MUTE,
+    KEY_GRABBER_NUM_ACTIONS
+} key_grabber_action;
+
+typedef void (*key_grabber_cb)(gdouble steps);
+
+void key_grabber_add_default_bindings(void);
+gboolean key_grabber_add_binding(const gchar *spec);
+void key_grabber_remove_bindings(void);
 void key_grabber_grab_keys(void);
 void key_grabber_ungrab_keys(void);
-void key_grabber_register_volume_raise_callback(key_grabber_cb cb);
-void key_grabber_register_volume_lower_callback(key_grabber_cb cb);
-void key_grabber_register_volume_mute_callback(key_grabber_cb cb);
+void key_grabber_register_callback(key_grabber_action action, key_grabber_cb cb);
+void key_grabber_queue_press(key_grabber_action action, gdouble steps);
 
 #endif
@@ -13,39 +13,114 @@
 #include <string.h>
 
 #include "audio_status.h"
+#include "control_socket.h"
+#include "event_log.h"
 #include "key_grabber.h"
 #include "notifications.h"
+#include "perf_stats.h"
 #include "pulse_glue.h"
+#include "state_export.h"
+#include "trace.h"
 #include "tray_icon.h"
+#include "volume_scale.h"
 
 #define KEY_STEP_SIZE 3.0
 
-static void volume_raise_key_pressed(void)
+// How long we wait for the first icon before initializing the rest
+// anyways, in milliseconds
+#define DEFERRED_INIT_TIMEOUT 3000
+
+static gboolean key_grabbing_enabled = TRUE, notifications_enabled = TRUE;
+static gboolean keys_grabbed = FALSE, deferred_init_done = FALSE;
+static guint deferred_init_source_id = 0, deferred_init_timeout_id = 0;
+
+static void volume_raise_key_pressed(gdouble steps)
 {
-    audio_status_raise_volume();
+    audio_status_step_volume(steps);
     pulse_glue_sync_volume();
     notifications_flash();
 }
 
-static void volume_lower_key_pressed(void)
+static void volume_lower_key_pressed(gdouble steps)
 {
-    audio_status_lower_volume();
+    audio_status_step_volume(-steps);
     pulse_glue_sync_volume();
     notifications_flash();
 }
 
-static void volume_mute_key_pressed(void)
+static void volume_mute_key_pressed(gdouble steps)
 {
     audio_status_toggle_muted();
     pulse_glue_sync_muted();
     notifications_flash();
 }
 
+static void mic_mute_key_pressed(gdouble steps)
+{
+    pulse_glue_toggle_source_muted();
+}
+
+static gboolean deferred_init(gpointer data)
+{
+    deferred_init_source_id = 0;
+    deferred_init_done = TRUE;
+    if (deferred_init_timeout_id) {
+        g_source_remove(deferred_init_timeout_id);
+        deferred_init_timeout_id = 0;
+    }
+
+    // Grab the keys if we're configured to grab them
+    if (key_grabbing_enabled) {
+        key_grabber_register_callback(KEY_GRABBER_VOLUME_RAISE, volume_raise_key_pressed);
+        key_grabber_register_callback(KEY_GRABBER_VOLUME_LOWER, volume_lower_key_pressed);
+        key_grabber_register_callback(KEY_GRABBER_VOLUME_MUTE, volume_mute_key_pressed);
+        key_grabber_register_callback(KEY_GRABBER_MIC_MUTE, mic_mute_key_pressed);
+        key_grabber_grab_keys();
+        keys_grabbed = TRUE;
+        perf_stats_mark_startup_phase("keys_grabbed");
+    }
+
+    // Get ready to show notifications
+    if (notifications_enabled)
+        notifications_preload();
+
+    // Get the volume popup ready to be shown
+    prepare_volume_scale();
+    return FALSE;
+}
+
+static void schedule_deferred_init(void)
+{
+    // Initialize what isn't needed to show the icon once there's nothing
+    // more important to do
+    if (deferred_init_done || deferred_init_source_id)
+        return;
+    deferred_init_source_id = g_idle_add_full(G_PRIORITY_LOW,
+            deferred_init, NULL, NULL);
+}
+
+static gboolean on_deferred_init_timeout(gpointer data)
+{
+    // The server is taking its time, don't keep the user waiting for
+    // the keys any longer
+    deferred_init_timeout_id = 0;
+    schedule_deferred_init();
+    return FALSE;
+}
+
 static void print_usage(FILE *out)
 {
     fprintf(out, "\
 Usage: \n\
     pa-applet [--disable-key-grabbing] [--disable-notifications]\n\
+              [--bind KEYS=ACTION[:STEPS]]... [--metrics-file FILE]\n\
+              [--record-events FILE] [--startup-profile]\n\
+              [--trace-file FILE]\n\
+    pa-applet [--disable-key-grabbing] [--disable-notifications]\n\
+              [--bind KEYS=ACTION[:STEPS]]... [--metrics-file FILE]\n\
+              --replay-events FILE [--replay-speed original|max]\n\
+    pa-applet --send COMMAND [ARGUMENT]\n\
+    pa-applet --monitor\n\
     pa-applet --help\n");
 }
 
@@ -54,12 +129,28 @@ int main(int argc, char **argv)
     struct option long_options[] = {
         { "help", no_argument, 0, 'h' },
         { "disable-key-grabbing", no_argument, 0, 0 },
+        { "bind", required_argument, 0, 0 },
         { "disable-notifications", no_argument, 0, 0 },
+        { "metrics-file", required_argument, 0, 0 },
+        { "record-events", required_argument, 0, 0 },
+        { "replay-events", required_argument, 0, 0 },
+        { "replay-speed", required_argument, 0, 0 },
+        { "send", required_argument, 0, 0 },
+        { "monitor", no_argument, 0, 0 },
+        { "startup-profile", no_argument, 0, 0 },
+        { "trace-file", required_argument, 0, 0 },
         { NULL, 0, 0, 0 }
     };
 
+    perf_stats_mark_startup_phase("main");
+
     // Parse the command line options
-    gboolean key_grabbing_enabled = TRUE, notifications_enabled = TRUE;
+    const char *metrics_path = NULL, *record_path = NULL, *replay_path = NULL;
+    const char *trace_path = NULL;
+    gboolean replay_max_speed = FALSE;
+    const char *send_command = NULL;
+    gboolean monitor = FALSE, startup_profile = FALSE;
+    GPtrArray *bind_specs = g_ptr_array_new();
     int opt, longindex;
     while ((opt = getopt_long(argc, argv, "c:fhp:s", long_options, &longindex)) != EOF) {
         switch ((char)opt) {
@@ -71,9 +162,42 @@ int main(int argc, char **argv)
                     key_grabbing_enabled = FALSE;
                     notifications_enabled = FALSE;
                 }
+                else if (!strcmp(long_options[longindex].name, "bind")) {
+                    g_ptr_array_add(bind_specs, optarg);
+                }
                 else if (!strcmp(long_options[longindex].name, "disable-notifications")) {
                     notifications_enabled = FALSE;
                 }
+                else if (!strcmp(long_options[longindex].name, "metrics-file")) {
+                    metrics_path = optarg;
+                }
+                else if (!strcmp(long_options[longindex].name, "record-events")) {
+                    record_path = optarg;
+                }
+                else if (!strcmp(long_options[longindex].name, "replay-events")) {
+                    replay_path = optarg;
+                }
+                else if (!strcmp(long_options[longindex].name, "replay-speed")) {
+                    if (!strcmp(optarg, "max")) {
+                        replay_max_speed = TRUE;
+                    }
+                    else if (strcmp(optarg, "original")) {
+                        print_usage(stderr);
+                        return EXIT_FAILURE;
+                    }
+                }
+                else if (!strcmp(long_options[longindex].name, "send")) {
+                    send_command = optarg;
+                }
+                else if (!strcmp(long_options[longindex].name, "monitor")) {
+                    monitor = TRUE;
+                }
+                else if (!strcmp(long_options[longindex].name, "startup-profile")) {
+                    startup_profile = TRUE;
+                }
+                else if (!strcmp(long_options[longindex].name, "trace-file")) {
+                    trace_path = optarg;
+                }
                 break;
             default:
                 print_usage(stderr);
@@ -81,40 +205,98 @@ int main(int argc, char **argv)
         }
     }
 
-    // Initialize GTK+
-    gtk_init(&argc, &argv);
+    // Just talk to the running instance if that's what we were asked to do,
+    // there's no need to initialize anything else for that
+    if (send_command) {
+        argv[optind - 1] = (char *)send_command;
+        gchar *command = g_strjoinv(" ", argv + optind - 1);
+        gboolean sent = control_socket_send(command);
+        g_free(command);
+        return sent ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (monitor)
+        return control_socket_monitor() ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    // Initialize everything else
+    // Print where the startup time goes once the icon is in the tray
+    if (startup_profile)
+        perf_stats_enable_startup_profile("embedded");
+
+    // Initialize what we need to talk to the server
+    trace_init(trace_path);
+    perf_stats_init(metrics_path);
     audio_status_init();
     pulse_glue_init();
-    create_tray_icon();
 
-    // Enable notifications if we'll use them
-    if (notifications_enabled)
-        notifications_init();
+    // Start recording the PulseAudio traffic if asked to
+    if (record_path && !event_log_start_recording(record_path))
+        return EXIT_FAILURE;
 
-    // Grab the keys if we're configured to grab them
+    // Get the Pulse stuff started, or replay a recording instead. This is
+    // done before initializing GTK+ so that the server gets to work on the
+    // connection in the meantime, nothing is dispatched until the main
+    // loop runs anyways
+    perf_stats_mark_startup_phase("connect");
+    if (replay_path) {
+        if (!pulse_glue_start_replay(replay_path, replay_max_speed))
+            return EXIT_FAILURE;
+    }
+    else {
+        pulse_glue_start();
+    }
+
+    // Initialize GTK+
+    gtk_init(&argc, &argv);
+    perf_stats_mark_startup_phase("gtk_init");
+
+    // Set up the key bindings, the ones from the command line replace the
+    // default ones for the same keys
     if (key_grabbing_enabled) {
-        key_grabber_register_volume_raise_callback(volume_raise_key_pressed);
-        key_grabber_register_volume_lower_callback(volume_lower_key_pressed);
-        key_grabber_register_volume_mute_callback(volume_mute_key_pressed);
-        key_grabber_grab_keys();
+        key_grabber_add_default_bindings();
+        for (guint i = 0; i < bind_specs->len; ++i) {
+            if (!key_grabber_add_binding(g_ptr_array_index(bind_specs, i)))
+                return EXIT_FAILURE;
+        }
     }
+    g_ptr_array_free(bind_specs, TRUE);
+
+    // Initialize everything else. Grabbing the keys and connecting to the
+    // notification daemon can wait until the first icon is shown
+    create_tray_icon();
+    set_tray_icon_shown_callback(schedule_deferred_init);
+    deferred_init_timeout_id = g_timeout_add(DEFERRED_INIT_TIMEOUT,
+            on_deferred_init_timeout, NULL);
+
+    // Enable notifications if we'll use them, they connect on first use
+    if (notifications_enabled)
+        notifications_init();
 
-    // Get the Pulse stuff started
-    pulse_glue_start();
+    // Accept commands from scripts and key bindings, and publish the
+    // state for the readers that only want to look at it
+    control_socket_start();
+    state_export_start();
 
     // Run the main loop
+    perf_stats_mark_startup_phase("main_loop");
     gtk_main();
 
     // Shut everything down
-    if (key_grabbing_enabled)
+    if (deferred_init_timeout_id)
+        g_source_remove(deferred_init_timeout_id);
+    if (deferred_init_source_id)
+        g_source_remove(deferred_init_source_id);
+    state_export_stop();
+    control_socket_stop();
+    if (keys_grabbed)
         key_grabber_ungrab_keys();
+    key_grabber_remove_bindings();
     if (notifications_enabled)
         notifications_destroy();
     destroy_tray_icon();
     pulse_glue_destroy();
     audio_status_destroy();
+    event_log_stop_recording();
+    perf_stats_destroy();
+    trace_destroy();
 
     return EXIT_SUCCESS;
 }
@@ -7,53 +7,64 @@
  *
  */
 
-#include <libnotify/notify.h>
+#include <gio/gio.h>
+#include <string.h>
 
 #include "audio_status.h"
+#include "perf_stats.h"
+#include "trace.h"
 
 #define PROGRAM_NAME "pa-applet"
 
-gboolean have_notifications = FALSE;
-NotifyNotification *notification = NULL;
+#define NOTIFICATIONS_BUS_NAME "org.freedesktop.Notifications"
+#define NOTIFICATIONS_OBJECT_PATH "/org/freedesktop/Notifications"
+#define NOTIFICATIONS_INTERFACE "org.freedesktop.Notifications"
 
-void notifications_init(void)
+// How long we wait for the notification daemon, in milliseconds
+#define NOTIFICATIONS_CALL_TIMEOUT 1000
+
+// The default expiration time of the notification daemon
+#define NOTIFICATIONS_EXPIRES_DEFAULT -1
+
+static gboolean have_notifications = FALSE;
+static GCancellable *cancellable = NULL;
+static GDBusConnection *bus = NULL;
+static gboolean have_capabilities = FALSE;
+static gboolean supports_private_synchronous = FALSE;
+static guint32 notification_id = 0;
+static gboolean call_in_flight = FALSE;
+static gboolean pending = FALSE;
+
+static void send_notification(void);
+
+static void on_notify_reply(GObject *source, GAsyncResult *result, gpointer data)
 {
-    if (notify_init(PROGRAM_NAME)) {
-        // Create and configure the notification
-        have_notifications = TRUE;
-#if NOTIFY_CHECK_VERSION(0, 7, 0)
-        notification = notify_notification_new(PROGRAM_NAME, NULL, NULL);
-#else
-        notification = notify_notification_new(PROGRAM_NAME, NULL, NULL, NULL);
-#endif
-        if (notification) {
-            notify_notification_set_timeout(notification, NOTIFY_EXPIRES_DEFAULT);
-            notify_notification_set_hint_string(notification, "synchronous", "volume");
-        }
-        else {
-            g_printerr("Failed to create a notification\n");
-        }
+    // Nothing else to do if we're shutting down
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
+    if (!reply && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free(error);
+        return;
+    }
+    call_in_flight = FALSE;
+
+    // Keep the ID so that the next notification replaces this one
+    if (reply) {
+        g_variant_get(reply, "(u)", &notification_id);
+        g_variant_unref(reply);
     }
     else {
-        g_printerr("Failed to initialize notifications\n");
+        g_printerr("Failed to show a notification: %s\n", error->message);
+        g_error_free(error);
     }
-}
 
-void notifications_destroy(void)
-{
-    if (have_notifications) {
-        notify_uninit();
-        if (notification)
-            g_object_unref(G_OBJECT(notification));
-    }
+    // Show the newest volume level if it changed in the meantime
+    if (pending)
+        send_notification();
 }
 
-void notifications_flash(void)
+static void send_notification(void)
 {
-    // Nothing to do if we don't support notifications
-    if (!have_notifications || !notification)
-        return;
-
     // Find the icon name
     const char *icon_name;
     audio_status *as = shared_audio_status();
@@ -69,12 +80,138 @@ void notifications_flash(void)
             icon_name = "audio-volume-high";
     }
 
-    // Update the notification volume
-    notify_notification_set_hint_int32(notification, "value", (gint)as->volume);
+    // Set the volume level and ask the daemon to show the notification
+    // as a synchronous one, replacing the previous one right away
+    GVariantBuilder hints;
+    g_variant_builder_init(&hints, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&hints, "{sv}", "value", g_variant_new_int32((gint32)as->volume));
+    g_variant_builder_add(&hints, "{sv}", "synchronous", g_variant_new_string("volume"));
+    if (supports_private_synchronous) {
+        g_variant_builder_add(&hints, "{sv}", "x-canonical-private-synchronous",
+                g_variant_new_string("volume"));
+    }
+
+    // Send it without waiting for the reply, the state is read again
+    // when the reply arrives if it changed in the meantime
+    g_dbus_connection_call(bus, NOTIFICATIONS_BUS_NAME, NOTIFICATIONS_OBJECT_PATH,
+            NOTIFICATIONS_INTERFACE, "Notify",
+            g_variant_new("(susssasa{sv}i)", PROGRAM_NAME, notification_id, icon_name,
+                PROGRAM_NAME, "", NULL, &hints, NOTIFICATIONS_EXPIRES_DEFAULT),
+            G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NONE, NOTIFICATIONS_CALL_TIMEOUT,
+            cancellable, on_notify_reply, NULL);
+    call_in_flight = TRUE;
+    pending = FALSE;
+    perf_stats_count(PERF_STATS_NOTIFICATIONS_SHOWN);
+}
+
+static void on_capabilities_reply(GObject *source, GAsyncResult *result, gpointer data)
+{
+    // Nothing else to do if we're shutting down
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
+    if (!reply && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free(error);
+        return;
+    }
+
+    // Remember what the daemon supports. If there's no daemon yet, keep
+    // trying to show notifications, it might be started later on
+    if (reply) {
+        GVariant *capabilities = g_variant_get_child_value(reply, 0);
+        const gchar **names = g_variant_get_strv(capabilities, NULL);
+        for (const gchar **name = names; *name; ++name) {
+            if (!strcmp(*name, "x-canonical-private-synchronous"))
+                supports_private_synchronous = TRUE;
+        }
+        g_free(names);
+        g_variant_unref(capabilities);
+        g_variant_unref(reply);
+    }
+    else {
+        g_printerr("Failed to get the notification daemon capabilities: %s\n",
+                error->message);
+        g_error_free(error);
+    }
+    have_capabilities = TRUE;
+
+    // Show what was requested while we were waiting
+    if (pending)
+        send_notification();
+}
+
+static void on_bus_ready(GObject *source, GAsyncResult *result, gpointer data)
+{
+    // Nothing else to do if we're shutting down
+    GError *error = NULL;
+    bus = g_bus_get_finish(result, &error);
+    if (!bus) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_printerr("Failed to initialize notifications: %s\n", error->message);
+            have_notifications = FALSE;
+        }
+        g_error_free(error);
+        return;
+    }
+
+    // Ask for the capabilities just once
+    g_dbus_connection_call(bus, NOTIFICATIONS_BUS_NAME, NOTIFICATIONS_OBJECT_PATH,
+            NOTIFICATIONS_INTERFACE, "GetCapabilities", NULL, G_VARIANT_TYPE("(as)"),
+            G_DBUS_CALL_FLAGS_NONE, NOTIFICATIONS_CALL_TIMEOUT, cancellable,
+            on_capabilities_reply, NULL);
+}
+
+static void connect_bus(void)
+{
+    // Connect to the session bus without blocking
+    cancellable = g_cancellable_new();
+    g_bus_get(G_BUS_TYPE_SESSION, cancellable, on_bus_ready, NULL);
+}
+
+void notifications_init(void)
+{
+    // Don't talk to the bus until we have to, there's a lot going on at
+    // login time and nothing to show yet anyways
+    have_notifications = TRUE;
+}
+
+void notifications_preload(void)
+{
+    // Get the connection and the capabilities ready ahead of time, so that
+    // the first notification is shown as quickly as the following ones
+    if (have_notifications && !cancellable)
+        connect_bus();
+}
+
+void notifications_destroy(void)
+{
+    if (cancellable) {
+        g_cancellable_cancel(cancellable);
+        g_object_unref(cancellable);
+        cancellable = NULL;
+        if (bus) {
+            g_object_unref(bus);
+            bus = NULL;
+        }
+    }
+    have_notifications = FALSE;
+}
+
+void notifications_flash(void)
+{
+    // Nothing to do if we don't support notifications
+    if (!have_notifications)
+        return;
+    gint64 begin = trace_begin();
 
-    // Update the notification icon
-    notify_notification_update(notification, PROGRAM_NAME, NULL, icon_name);
+    // Connect to the bus if we haven't done so yet, the notification is
+    // shown as soon as we're connected
+    if (!cancellable)
+        connect_bus();
 
-    // Show the notification
-    notify_notification_show(notification, NULL);
+    // Only keep one notification in flight, the newest volume level is
+    // shown once it completes
+    pending = TRUE;
+    if (bus && have_capabilities && !call_in_flight)
+        send_notification();
+    trace_end("ui", "notifications_flash", begin);
 }
@@ -11,6 +11,7 @@
 #define NOTIFICATIONS_H
 
 void notifications_init(void);
+void notifications_preload(void);
 void notifications_destroy(void);
 void notifications_flash(void);
 
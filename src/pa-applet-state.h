@@ -0,0 +1,147 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+/*
+ * The state pa-applet publishes in $XDG_RUNTIME_DIR/pa-applet.state, along
+ * with everything needed to read it. Reading a snapshot takes no system
+ * calls, so it can be done as often as needed:
+ *
+ *     pa_applet_state_map map;
+ *     pa_applet_state state;
+ *     if (pa_applet_state_open(&map) == 0) {
+ *         if (pa_applet_state_read(&map, &state) == 0)
+ *             printf("%s %.0f%%\n", state.sink, state.volume);
+ *         pa_applet_state_close(&map);
+ *     }
+ *
+ * The applet updates the state with a sequence lock: the sequence number
+ * is odd while an update is in progress, and readers retry until they see
+ * the same even number before and after copying the state.
+ */
+
+#ifndef PA_APPLET_STATE_H
+#define PA_APPLET_STATE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PA_APPLET_STATE_FILE_NAME "pa-applet.state"
+#define PA_APPLET_STATE_MAGIC 0x74617470u
+#define PA_APPLET_STATE_VERSION 1
+#define PA_APPLET_STATE_NAME_SIZE 256
+
+// How many times a reader retries while the state is being updated
+#define PA_APPLET_STATE_READ_ATTEMPTS 1000
+
+// The applet is running, connected to the server, and the sink is muted
+#define PA_APPLET_STATE_RUNNING (1u << 0)
+#define PA_APPLET_STATE_CONNECTED (1u << 1)
+#define PA_APPLET_STATE_MUTED (1u << 2)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t flags;
+    uint64_t changes;
+    double volume;
+    char sink[PA_APPLET_STATE_NAME_SIZE];
+    char profile[PA_APPLET_STATE_NAME_SIZE];
+} pa_applet_state;
+
+typedef struct {
+    int fd;
+    const pa_applet_state *shared;
+} pa_applet_state_map;
+
+static inline int pa_applet_state_open(pa_applet_state_map *map)
+{
+    // Find the file in the same place the applet does. Like GLib, fall
+    // back to the cache directory if there's no runtime directory
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    const char *subdir = "";
+    if (!dir || !*dir) {
+        dir = getenv("XDG_CACHE_HOME");
+        if (!dir || !*dir) {
+            dir = getenv("HOME");
+            subdir = "/.cache";
+        }
+    }
+    if (!dir || !*dir)
+        return -1;
+    size_t length = strlen(dir) + strlen(subdir) + sizeof(PA_APPLET_STATE_FILE_NAME) + 1;
+    char *path = (char *)malloc(length);
+    if (!path)
+        return -1;
+    strcpy(path, dir);
+    strcat(path, subdir);
+    strcat(path, "/" PA_APPLET_STATE_FILE_NAME);
+
+    // Map it read only, it's shared with the applet from then on. Touching
+    // the pages of a file that's too short would raise SIGBUS, which
+    // happens if the applet died while creating it or if it's an older
+    // layout
+    map->fd = open(path, O_RDONLY);
+    free(path);
+    if (map->fd < 0)
+        return -1;
+    struct stat info;
+    if (fstat(map->fd, &info) < 0 || info.st_size < (off_t)sizeof(pa_applet_state)) {
+        close(map->fd);
+        return -1;
+    }
+    void *shared = mmap(NULL, sizeof(pa_applet_state), PROT_READ, MAP_SHARED, map->fd, 0);
+    if (shared == MAP_FAILED) {
+        close(map->fd);
+        return -1;
+    }
+    map->shared = (const pa_applet_state *)shared;
+    return 0;
+}
+
+static inline void pa_applet_state_close(pa_applet_state_map *map)
+{
+    munmap((void *)map->shared, sizeof(pa_applet_state));
+    close(map->fd);
+}
+
+static inline int pa_applet_state_read(const pa_applet_state_map *map,
+        pa_applet_state *snapshot)
+{
+    const pa_applet_state *shared = map->shared;
+    for (int i = 0; i < PA_APPLET_STATE_READ_ATTEMPTS; ++i) {
+        // Wait for the update in progress to finish
+        uint32_t before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+
+        // Copy the state, and make sure it wasn't updated in the meantime
+        memcpy(snapshot, shared, sizeof(pa_applet_state));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t after = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED);
+        if (before != after)
+            continue;
+
+        // Refuse to interpret a layout we don't know
+        if (snapshot->magic != PA_APPLET_STATE_MAGIC ||
+                snapshot->version != PA_APPLET_STATE_VERSION)
+            return -1;
+        snapshot->sink[PA_APPLET_STATE_NAME_SIZE - 1] = '\0';
+        snapshot->profile[PA_APPLET_STATE_NAME_SIZE - 1] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,519 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#define METRICS_WRITE_INTERVAL 15
+#define MAX_STARTUP_PHASES 16
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "perf_stats.h"
+#include "trace.h"
+
+typedef struct {
+    const gchar *name;
+    guint64 count;
+    guint64 failures;
+    gint64 total_latency;
+    gint64 max_latency;
+    GArray *pending;
+    guint pending_head;
+    guint64 *buckets;
+} operation_stats;
+
+typedef struct {
+    const gchar *name;
+    gint64 time;
+    gint64 cpu_time;
+} startup_phase;
+
+typedef struct {
+    const gchar *metric;
+    const gchar *label;
+    const gchar *help;
+} counter_info;
+
+// Upper bounds of the latency histogram buckets, in microseconds, along
+// with their Prometheus representation in seconds. The last bucket
+// catches everything else
+static const gint64 bucket_bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000
+};
+static const gchar *bucket_labels[] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01",
+    "0.025", "0.05", "0.1", "0.25", "0.5", "1", "+Inf"
+};
+
+#define NUM_BUCKETS (G_N_ELEMENTS(bucket_bounds) + 1)
+
+static guint64 operation_buckets[PERF_STATS_NUM_OPERATIONS][NUM_BUCKETS];
+
+static operation_stats operations[PERF_STATS_NUM_OPERATIONS] = {
+    { "server_info", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SERVER_INFO] },
+    { "sink_info", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SINK_INFO] },
+    { "source_info", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SOURCE_INFO] },
+    { "card_info", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_CARD_INFO] },
+    { "set_volume", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SET_VOLUME] },
+    { "set_mute", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SET_MUTE] },
+    { "set_profile", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SET_PROFILE] },
+    { "set_source_mute", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SET_SOURCE_MUTE] },
+    { "sink_input_info", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SINK_INPUT_INFO] },
+    { "set_sink_input_volume", 0, 0, 0, 0, NULL, 0,
+        operation_buckets[PERF_STATS_SET_SINK_INPUT_VOLUME] },
+    { "set_sink_input_mute", 0, 0, 0, 0, NULL, 0,
+        operation_buckets[PERF_STATS_SET_SINK_INPUT_MUTE] },
+    { "set_default_sink", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_SET_DEFAULT_SINK] },
+    { "move_sink_input", 0, 0, 0, 0, NULL, 0, operation_buckets[PERF_STATS_MOVE_SINK_INPUT] }
+};
+
+static const counter_info counter_infos[PERF_STATS_NUM_COUNTERS] = {
+    { "pa_applet_subscription_events_total", "facility=\"server\"",
+        "Subscription events received from the server" },
+    { "pa_applet_subscription_events_total", "facility=\"card\"", NULL },
+    { "pa_applet_subscription_events_total", "facility=\"sink\"", NULL },
+    { "pa_applet_subscription_events_total", "facility=\"source\"", NULL },
+    { "pa_applet_subscription_events_total", "facility=\"sink_input\"", NULL },
+    { "pa_applet_ui_refreshes_total", "target=\"tray_icon\"",
+        "Refreshes of the user interface" },
+    { "pa_applet_ui_refreshes_total", "target=\"volume_scale\"", NULL },
+    { "pa_applet_ui_refreshes_total", "target=\"stream_mixer\"", NULL },
+    { "pa_applet_notifications_shown_total", NULL,
+        "Volume notifications shown" },
+    { "pa_applet_reconnects_total", NULL,
+        "Reconnections to the server after a failure" },
+    { "pa_applet_peak_fragments_total", NULL,
+        "Fragments read from the level meter stream" },
+    { "pa_applet_echoes_ignored_total", NULL,
+        "Values from the server ignored because a newer local change was pending" }
+};
+
+static guint64 counters[PERF_STATS_NUM_COUNTERS];
+
+// Sequence numbers of the operations of each type, used to pair up their
+// spans in the trace
+static guint32 trace_issued[PERF_STATS_NUM_OPERATIONS];
+static guint32 trace_completed[PERF_STATS_NUM_OPERATIONS];
+static startup_phase startup_phases[MAX_STARTUP_PHASES];
+static guint num_startup_phases = 0;
+static const gchar *startup_profile_phase = NULL;
+static guint64 popups_shown = 0;
+static gint64 first_popup_latency = 0, last_popup_latency = 0, max_popup_latency = 0;
+static guint64 sink_switches = 0;
+static gint64 last_switch_latency = 0, max_switch_latency = 0;
+static guint last_switch_streams = 0;
+static gint64 start_time = 0;
+static gchar *metrics_file_path = NULL;
+static guint signal_source_id = 0, metrics_source_id = 0;
+
+static gboolean on_dump_signal(gpointer data)
+{
+    // Dump the stats in human readable form, and refresh the metrics file
+    perf_stats_dump(stderr);
+    if (metrics_file_path)
+        perf_stats_write_metrics(metrics_file_path);
+    return TRUE;
+}
+
+static gboolean on_metrics_timeout(gpointer data)
+{
+    perf_stats_write_metrics(metrics_file_path);
+    return TRUE;
+}
+
+void perf_stats_init(const gchar *metrics_path)
+{
+    start_time = g_get_monotonic_time();
+
+    // Dump the stats whenever we're asked to
+    signal_source_id = g_unix_signal_add(SIGUSR1, on_dump_signal, NULL);
+
+    // Keep the metrics file reasonably up to date if we have one
+    if (metrics_path) {
+        metrics_file_path = g_strdup(metrics_path);
+        perf_stats_write_metrics(metrics_file_path);
+        metrics_source_id = g_timeout_add_seconds(METRICS_WRITE_INTERVAL,
+                on_metrics_timeout, NULL);
+    }
+}
+
+void perf_stats_destroy(void)
+{
+    if (signal_source_id) {
+        g_source_remove(signal_source_id);
+        signal_source_id = 0;
+    }
+
+    // Leave the final numbers behind
+    if (metrics_file_path) {
+        g_source_remove(metrics_source_id);
+        metrics_source_id = 0;
+        perf_stats_write_metrics(metrics_file_path);
+        g_free(metrics_file_path);
+        metrics_file_path = NULL;
+    }
+
+    for (guint i = 0; i < PERF_STATS_NUM_OPERATIONS; ++i) {
+        if (operations[i].pending) {
+            g_array_free(operations[i].pending, TRUE);
+            operations[i].pending = NULL;
+        }
+    }
+}
+
+void perf_stats_operation_issued(perf_stats_operation op, gboolean issued)
+{
+    operation_stats *stats = &operations[op];
+    ++stats->count;
+
+    // Operations that couldn't even be issued won't ever complete
+    if (!issued) {
+        ++stats->failures;
+        return;
+    }
+
+    // The server replies to the operations of each type in the order they
+    // were issued, so a queue of timestamps is all we need to match them
+    gint64 now = g_get_monotonic_time();
+    if (!stats->pending)
+        stats->pending = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_array_append_val(stats->pending, now);
+    trace_async_begin("pulse", stats->name, (guint64)op << 32 | trace_issued[op]++);
+}
+
+void perf_stats_operation_completed(perf_stats_operation op, gboolean success)
+{
+    // Ignore the replies to operations we didn't issue (e.g. replayed ones)
+    operation_stats *stats = &operations[op];
+    if (!stats->pending || stats->pending_head == stats->pending->len)
+        return;
+
+    // Take the oldest operation off the queue, reusing the queue storage
+    // once it's been drained
+    gint64 issued_at = g_array_index(stats->pending, gint64, stats->pending_head++);
+    trace_async_end("pulse", stats->name, (guint64)op << 32 | trace_completed[op]++);
+    if (stats->pending_head == stats->pending->len) {
+        g_array_set_size(stats->pending, 0);
+        stats->pending_head = 0;
+    }
+
+    // Account for the latency
+    gint64 latency = g_get_monotonic_time() - issued_at;
+    stats->total_latency += latency;
+    if (latency > stats->max_latency)
+        stats->max_latency = latency;
+    guint bucket = 0;
+    while (bucket < G_N_ELEMENTS(bucket_bounds) && latency > bucket_bounds[bucket])
+        ++bucket;
+    ++stats->buckets[bucket];
+
+    if (!success)
+        ++stats->failures;
+}
+
+void perf_stats_forget_pending_operations(void)
+{
+    // The operations in flight were lost along with the connection
+    for (guint i = 0; i < PERF_STATS_NUM_OPERATIONS; ++i) {
+        operation_stats *stats = &operations[i];
+        if (!stats->pending)
+            continue;
+        stats->failures += stats->pending->len - stats->pending_head;
+        trace_completed[i] = trace_issued[i];
+        g_array_set_size(stats->pending, 0);
+        stats->pending_head = 0;
+    }
+}
+
+void perf_stats_count(perf_stats_counter counter)
+{
+    ++counters[counter];
+}
+
+static gint64 cpu_time_now(void)
+{
+    // The CPU time of the whole process, threads included
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) < 0)
+        return 0;
+    return ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static gint64 process_start_time(void)
+{
+    // The kernel knows when we were started, in clock ticks since boot.
+    // Comparing that with the boot clock tells us how long ago it was,
+    // which accounts for the dynamic loader and the library constructors
+    gchar *contents = NULL;
+    if (!g_file_get_contents("/proc/self/stat", &contents, NULL, NULL))
+        return 0;
+
+    // The command name can contain anything, so skip past it first. The
+    // start time is the 20th field after it
+    gint64 start_time = 0;
+    gchar *fields = strrchr(contents, ')');
+    if (fields) {
+        gchar **tokens = g_strsplit(fields + 2, " ", 21);
+        if (g_strv_length(tokens) > 19) {
+            struct timespec ts;
+            guint64 ticks = g_ascii_strtoull(tokens[19], NULL, 10);
+            if (clock_gettime(CLOCK_BOOTTIME, &ts) == 0) {
+                gint64 since_boot = ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+                gint64 started = ticks * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK);
+                start_time = g_get_monotonic_time() - (since_boot - started);
+            }
+        }
+        g_strfreev(tokens);
+    }
+    g_free(contents);
+    return start_time;
+}
+
+void perf_stats_enable_startup_profile(const gchar *last_phase)
+{
+    startup_profile_phase = last_phase;
+}
+
+void perf_stats_mark_startup_phase(const gchar *phase)
+{
+    // Only the first time each phase is reached counts
+    for (guint i = 0; i < num_startup_phases; ++i) {
+        if (!strcmp(startup_phases[i].name, phase))
+            return;
+    }
+    if (num_startup_phases == MAX_STARTUP_PHASES)
+        return;
+
+    // Phases are timed from the first one
+    gint64 now = g_get_monotonic_time();
+    startup_phases[num_startup_phases].name = phase;
+    startup_phases[num_startup_phases].time = now;
+    startup_phases[num_startup_phases].cpu_time = cpu_time_now();
+    ++num_startup_phases;
+    g_debug("Reached startup phase %s after %.3f ms", phase,
+            (now - startup_phases[0].time) / 1000.0);
+
+    // Print the profile once we've made it all the way through startup
+    if (startup_profile_phase && !strcmp(phase, startup_profile_phase)) {
+        perf_stats_print_startup_profile(stderr);
+        startup_profile_phase = NULL;
+    }
+}
+
+void perf_stats_print_startup_profile(FILE *out)
+{
+    if (!num_startup_phases)
+        return;
+
+    // Time everything from the moment the process was started, falling
+    // back to the first phase if we can't tell when that was
+    gint64 origin = process_start_time();
+    if (!origin || origin > startup_phases[0].time)
+        origin = startup_phases[0].time;
+
+    fprintf(out, "%-14s %10s %10s %10s %10s\n", "phase",
+            "wall (ms)", "+wall", "cpu (ms)", "+cpu");
+    gint64 last_time = origin, last_cpu_time = 0;
+    for (guint i = 0; i < num_startup_phases; ++i) {
+        const startup_phase *phase = &startup_phases[i];
+        fprintf(out, "%-14s %10.3f %10.3f %10.3f %10.3f\n", phase->name,
+                (phase->time - origin) / 1000.0, (phase->time - last_time) / 1000.0,
+                phase->cpu_time / 1000.0, (phase->cpu_time - last_cpu_time) / 1000.0);
+        last_time = phase->time;
+        last_cpu_time = phase->cpu_time;
+    }
+}
+
+void perf_stats_popup_shown(gint64 latency)
+{
+    // The first popup is the one that has to be ready before anything
+    // was shown, so keep it apart from the rest
+    if (!popups_shown)
+        first_popup_latency = latency;
+    last_popup_latency = latency;
+    if (latency > max_popup_latency)
+        max_popup_latency = latency;
+    ++popups_shown;
+    g_debug("Popup %" G_GUINT64_FORMAT " took %" G_GINT64_FORMAT " us to show up",
+            popups_shown, latency);
+}
+
+void perf_stats_sink_switched(gint64 latency, guint num_streams)
+{
+    // The latency covers setting the default sink and moving the streams
+    last_switch_latency = latency;
+    last_switch_streams = num_streams;
+    if (latency > max_switch_latency)
+        max_switch_latency = latency;
+    ++sink_switches;
+    g_debug("Switching the default sink and moving %u streams took %"
+            G_GINT64_FORMAT " us", num_streams, latency);
+}
+
+static guint64 completed_operations(const operation_stats *stats)
+{
+    guint64 completed = 0;
+    for (guint i = 0; i < NUM_BUCKETS; ++i)
+        completed += stats->buckets[i];
+    return completed;
+}
+
+void perf_stats_dump(FILE *out)
+{
+    fprintf(out, "pa-applet performance counters after %.1f s\n",
+            (g_get_monotonic_time() - start_time) / (gdouble)G_USEC_PER_SEC);
+
+    // Operations, with their latency histograms in milliseconds
+    fprintf(out, "%-12s %8s %8s %10s %10s  histogram (ms:",
+            "operation", "count", "failed", "mean (ms)", "max (ms)");
+    for (guint i = 0; i < G_N_ELEMENTS(bucket_bounds); ++i)
+        fprintf(out, " %g", bucket_bounds[i] / 1000.0);
+    fprintf(out, " inf)\n");
+    for (guint i = 0; i < PERF_STATS_NUM_OPERATIONS; ++i) {
+        const operation_stats *stats = &operations[i];
+        guint64 completed = completed_operations(stats);
+        fprintf(out, "%-12s %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %10.3f %10.3f ",
+                stats->name, stats->count, stats->failures,
+                completed ? stats->total_latency / 1000.0 / completed : 0.0,
+                stats->max_latency / 1000.0);
+        for (guint j = 0; j < NUM_BUCKETS; ++j)
+            fprintf(out, " %" G_GUINT64_FORMAT, stats->buckets[j]);
+        fprintf(out, "\n");
+    }
+
+    // When each startup phase was reached
+    fprintf(out, "startup (ms):");
+    for (guint i = 0; i < num_startup_phases; ++i) {
+        fprintf(out, " %s=%.3f", startup_phases[i].name,
+                (startup_phases[i].time - startup_phases[0].time) / 1000.0);
+    }
+    fprintf(out, "\n");
+
+    // How long the volume popup took to show up
+    fprintf(out, "popup (ms): shown=%" G_GUINT64_FORMAT " first=%.3f last=%.3f max=%.3f\n",
+            popups_shown, first_popup_latency / 1000.0, last_popup_latency / 1000.0,
+            max_popup_latency / 1000.0);
+
+    // How long switching the default sink took
+    fprintf(out, "sink switch (ms): switches=%" G_GUINT64_FORMAT " last=%.3f (%u streams) max=%.3f\n",
+            sink_switches, last_switch_latency / 1000.0, last_switch_streams,
+            max_switch_latency / 1000.0);
+
+    // Everything else
+    for (guint i = 0; i < PERF_STATS_NUM_COUNTERS; ++i) {
+        const counter_info *info = &counter_infos[i];
+        fprintf(out, "%s%s%s%s %" G_GUINT64_FORMAT "\n", info->metric,
+                info->label ? "{" : "", info->label ? info->label : "",
+                info->label ? "}" : "", counters[i]);
+    }
+}
+
+static void append_seconds(GString *text, gint64 usec)
+{
+    // Don't let the locale change the decimal separator
+    gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+    g_string_append(text, g_ascii_dtostr(buffer, sizeof(buffer),
+                usec / (gdouble)G_USEC_PER_SEC));
+}
+
+gboolean perf_stats_write_metrics(const gchar *path)
+{
+    GString *text = g_string_new(NULL);
+
+    // Operations
+    g_string_append(text,
+            "# HELP pa_applet_operations_total Operations issued to the server\n"
+            "# TYPE pa_applet_operations_total counter\n");
+    for (guint i = 0; i < PERF_STATS_NUM_OPERATIONS; ++i) {
+        g_string_append_printf(text, "pa_applet_operations_total{op=\"%s\"} %"
+                G_GUINT64_FORMAT "\n", operations[i].name, operations[i].count);
+    }
+    g_string_append(text,
+            "# HELP pa_applet_operation_failures_total Operations that failed\n"
+            "# TYPE pa_applet_operation_failures_total counter\n");
+    for (guint i = 0; i < PERF_STATS_NUM_OPERATIONS; ++i) {
+        g_string_append_printf(text, "pa_applet_operation_failures_total{op=\"%s\"} %"
+                G_GUINT64_FORMAT "\n", operations[i].name, operations[i].failures);
+    }
+
+    // Operation latencies
+    g_string_append(text,
+            "# HELP pa_applet_operation_latency_seconds Time between issuing an operation and its reply\n"
+            "# TYPE pa_applet_operation_latency_seconds histogram\n");
+    for (guint i = 0; i < PERF_STATS_NUM_OPERATIONS; ++i) {
+        const operation_stats *stats = &operations[i];
+        guint64 cumulative = 0;
+        for (guint j = 0; j < NUM_BUCKETS; ++j) {
+            cumulative += stats->buckets[j];
+            g_string_append_printf(text, "pa_applet_operation_latency_seconds_bucket"
+                    "{op=\"%s\",le=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                    stats->name, bucket_labels[j], cumulative);
+        }
+        g_string_append_printf(text, "pa_applet_operation_latency_seconds_sum{op=\"%s\"} ",
+                stats->name);
+        append_seconds(text, stats->total_latency);
+        g_string_append_printf(text, "\npa_applet_operation_latency_seconds_count{op=\"%s\"} %"
+                G_GUINT64_FORMAT "\n", stats->name, cumulative);
+    }
+
+    // How long the volume popup took to show up
+    if (popups_shown) {
+        g_string_append(text,
+                "# HELP pa_applet_popup_show_latency_seconds Time between asking for the volume popup and drawing it\n"
+                "# TYPE pa_applet_popup_show_latency_seconds gauge\n"
+                "pa_applet_popup_show_latency_seconds{popup=\"first\"} ");
+        append_seconds(text, first_popup_latency);
+        g_string_append(text, "\npa_applet_popup_show_latency_seconds{popup=\"last\"} ");
+        append_seconds(text, last_popup_latency);
+        g_string_append(text, "\npa_applet_popup_show_latency_seconds{popup=\"max\"} ");
+        append_seconds(text, max_popup_latency);
+        g_string_append(text, "\n");
+    }
+
+    // How long switching the default sink took
+    if (sink_switches) {
+        g_string_append(text,
+                "# HELP pa_applet_sink_switch_latency_seconds Time between switching the default sink and the last stream moving to it\n"
+                "# TYPE pa_applet_sink_switch_latency_seconds gauge\n"
+                "pa_applet_sink_switch_latency_seconds{switch=\"last\"} ");
+        append_seconds(text, last_switch_latency);
+        g_string_append(text, "\npa_applet_sink_switch_latency_seconds{switch=\"max\"} ");
+        append_seconds(text, max_switch_latency);
+        g_string_append_printf(text, "\n"
+                "# HELP pa_applet_sink_switch_streams Streams moved by the last switch of the default sink\n"
+                "# TYPE pa_applet_sink_switch_streams gauge\n"
+                "pa_applet_sink_switch_streams %u\n", last_switch_streams);
+    }
+
+    // Everything else
+    for (guint i = 0; i < PERF_STATS_NUM_COUNTERS; ++i) {
+        const counter_info *info = &counter_infos[i];
+        if (info->help) {
+            g_string_append_printf(text, "# HELP %s %s\n# TYPE %s counter\n",
+                    info->metric, info->help, info->metric);
+        }
+        g_string_append_printf(text, "%s%s%s%s %" G_GUINT64_FORMAT "\n", info->metric,
+                info->label ? "{" : "", info->label ? info->label : "",
+                info->label ? "}" : "", counters[i]);
+    }
+
+    // Replace the file atomically so that scrapers never see half of it
+    GError *error = NULL;
+    gboolean ok = g_file_set_contents(path, text->str, text->len, &error);
+    if (!ok) {
+        g_printerr("Failed to write %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(text, TRUE);
+    return ok;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef PERF_STATS_H
+#define PERF_STATS_H
+
+#include <glib.h>
+#include <stdio.h>
+
+typedef enum {
+    PERF_STATS_SERVER_INFO,
+    PERF_STATS_SINK_INFO,
+    PERF_STATS_SOURCE_INFO,
+    PERF_STATS_CARD_INFO,
+    PERF_STATS_SET_VOLUME,
+    PERF_STATS_SET_MUTE,
+    PERF_STATS_SET_PROFILE,
+    PERF_STATS_SET_SOURCE_MUTE,
+    PERF_STATS_SINK_INPUT_INFO,
+    PERF_STATS_SET_SINK_INPUT_VOLUME,
+    PERF_STATS_SET_SINK_INPUT_MUTE,
+    PERF_STATS_SET_DEFAULT_SINK,
+    PERF_STATS_MOVE_SINK_INPUT,
+    PERF_STATS_NUM_OPERATIONS
+} perf_stats_operation;
+
+typedef enum {
+    PERF_STATS_SERVER_EVENTS,
+    PERF_STATS_CARD_EVENTS,
+    PERF_STATS_SINK_EVENTS,
+    PERF_STATS_SOURCE_EVENTS,
+    PERF_STATS_SINK_INPUT_EVENTS,
+    PERF_STATS_TRAY_ICON_UPDATES,
+    PERF_STATS_VOLUME_SCALE_UPDATES,
+    PERF_STATS_STREAM_MIXER_UPDATES,
+    PERF_STATS_NOTIFICATIONS_SHOWN,
+    PERF_STATS_RECONNECTS,
+    PERF_STATS_PEAK_FRAGMENTS,
+    PERF_STATS_ECHOES_IGNORED,
+    PERF_STATS_NUM_COUNTERS
+} perf_stats_counter;
+
+void perf_stats_init(const gchar *metrics_path);
+void perf_stats_destroy(void);
+void perf_stats_operation_issued(perf_stats_operation op, gboolean issued);
+void perf_stats_operation_completed(perf_stats_operation op, gboolean success);
+void perf_stats_forget_pending_operations(void);
+void perf_stats_count(perf_stats_counter counter);
+void perf_stats_popup_shown(gint64 latency);
+void perf_stats_sink_switched(gint64 latency, guint num_streams);
+void perf_stats_mark_startup_phase(const gchar *phase);
+void perf_stats_enable_startup_profile(const gchar *last_phase);
+void perf_stats_print_startup_profile(FILE *out);
+void perf_stats_dump(FILE *out);
+gboolean perf_stats_write_metrics(const gchar *path);
+
+#endif
@@ -8,111 +8,228 @@
  */
 
 #include <gtk/gtk.h>
-#include <string.h>
 
 #include "audio_status.h"
 #include "pulse_glue.h"
 
-static GSList *profile_names = NULL;
+// The menu is built once and patched whenever the sinks or the profiles
+// change. Its items are reused, the one at each position stands for the
+// sink or the profile at that position
+static GtkWidget *menu = NULL, *separator;
+static GPtrArray *sink_items = NULL, *profile_items = NULL;
+static gboolean patching_menu = FALSE;
+
+// The sinks listed in the menu, by position, and the layout of the card
+// profiles the last time the menu was patched
+static GArray *menu_sinks = NULL;
+static guint64 menu_layout = 0;
+
+static void patch_menu(void);
 
 void destroy_popup_menu(void)
 {
-    // Nothing needs to be done at the moment
+    // Get rid of the menu and all of its items
+    if (menu) {
+        gtk_widget_destroy(menu);
+        menu = NULL;
+        g_ptr_array_free(sink_items, TRUE);
+        sink_items = NULL;
+        g_ptr_array_free(profile_items, TRUE);
+        profile_items = NULL;
+        g_array_free(menu_sinks, TRUE);
+        menu_sinks = NULL;
+    }
 }
 
-static void on_selection_done(GtkMenu *menu, gpointer data)
+static void on_sink_item_activate(GtkMenuItem *item, gpointer data)
 {
-    // Get rid of the copied profile names
-    g_slist_free_full(profile_names, (GDestroyNotify)g_free);
-    profile_names = NULL;
+    // Nothing to do if we're the ones changing the check marks
+    if (patching_menu)
+        return;
+
+    // Switch to the sink unless it's already the default one. If it's
+    // gone, there's nothing to switch to
+    uint32_t index = g_array_index(menu_sinks, uint32_t, GPOINTER_TO_UINT(data));
+    if (index != pulse_glue_get_default_sink_index())
+        pulse_glue_set_default_sink(index);
+
+    // GTK+ toggled the item that was clicked, put the check marks back
+    // where they belong until the server confirms the switch
+    patch_menu();
 }
 
-static void on_item_activate(GtkMenuItem *item, gpointer data)
+static void on_profile_item_activate(GtkMenuItem *item, gpointer data)
 {
-    // Find the corresponding profile
-    gchar *profile_name = (gchar *)data;
-    audio_status_profile *profile = NULL;
-    audio_status *as = shared_audio_status();
-    for (GSList *entry = as->profiles; entry; entry = g_slist_next(entry)) {
-        audio_status_profile *prof = (audio_status_profile *)entry->data;
-        if (!strcmp(prof->name, profile_name)) {
-            profile = prof;
-            break;
-        }
-    }
+    // Nothing to do if we're the ones changing the check marks
+    if (patching_menu)
+        return;
 
     // It might happen that the profile can't be found, e.g., if the list
     // of profiles has since changed (it's unlikely, but maybe the user
     // changed the default card between showing the menu and now)
-    if (!profile) {
+    audio_status *as = shared_audio_status();
+    guint position = GPOINTER_TO_UINT(data), num_profiles;
+    audio_status_profile *profiles = audio_status_get_profiles(&num_profiles);
+    if (!as->card || as->card->layout != menu_layout || position >= num_profiles) {
         g_debug("The selected profile doesn't exist anymore, ignoring");
+        patch_menu();
         return;
     }
 
-    // If this profile is already active, nothing to do
-    if (profile->active)
-        return;
-
-    // Set all profiles to not active
-    for (GSList *entry = as->profiles; entry; entry = g_slist_next(entry)) {
-        audio_status_profile *prof = (audio_status_profile *)entry->data;
-        prof->active = FALSE;
+    // Set the selected profile as the only active one and sync, unless
+    // it's already active
+    audio_status_profile *profile = &profiles[position];
+    if (!profile->active) {
+        audio_status_set_active_profile(profile);
+        pulse_glue_sync_active_profile();
     }
 
-    // Set the selected profile to active and sync
-    profile->active = TRUE;
-    pulse_glue_sync_active_profile();
+    // GTK+ toggled the item that was clicked, put the check marks back
+    // where they belong
+    patch_menu();
 }
 
-void show_popup_menu(GtkStatusIcon *status_icon)
+static gint compare_sinks(gconstpointer a, gconstpointer b)
 {
-    // Right now we shouldn't have any profile names referenced
-    g_assert(!profile_names);
+    uint32_t first = *(const uint32_t *)a, second = *(const uint32_t *)b;
+    return first < second ? -1 : first > second;
+}
 
-    // Nothing to do if we have no entries
-    audio_status *as = shared_audio_status();
-    if (!as->profiles)
-        return;
+static void add_menu_sink(gpointer key, gpointer value, gpointer data)
+{
+    uint32_t index = GPOINTER_TO_UINT(key);
+    g_array_append_val(menu_sinks, index);
+}
+
+static void patch_sink_items(void)
+{
+    // List the sinks in a stable order, but only if there's a choice
+    g_array_set_size(menu_sinks, 0);
+    audio_status_foreach_sink(add_menu_sink, NULL);
+    if (menu_sinks->len < 2)
+        g_array_set_size(menu_sinks, 0);
+    g_array_sort(menu_sinks, compare_sinks);
+
+    // Add the items we're missing, right before the separator
+    while (sink_items->len < menu_sinks->len) {
+        GtkWidget *item = gtk_check_menu_item_new_with_label("");
+        gtk_check_menu_item_set_draw_as_radio(GTK_CHECK_MENU_ITEM(item), TRUE);
+        gtk_menu_shell_insert(GTK_MENU_SHELL(menu), item, sink_items->len);
+        g_signal_connect(G_OBJECT(item), "activate", G_CALLBACK(on_sink_item_activate),
+                GUINT_TO_POINTER(sink_items->len));
+        gtk_widget_show(item);
+        g_ptr_array_add(sink_items, item);
+    }
+
+    // And get rid of the ones we don't need anymore
+    while (sink_items->len > menu_sinks->len) {
+        gtk_widget_destroy(GTK_WIDGET(g_ptr_array_index(sink_items, sink_items->len - 1)));
+        g_ptr_array_set_size(sink_items, sink_items->len - 1);
+    }
 
-    // Create the menu
-    GtkWidget *menu = gtk_menu_new();
-    g_signal_connect(G_OBJECT(menu), "selection-done", G_CALLBACK(on_selection_done), NULL);
+    // Only touch what actually changed in the rest of them
+    uint32_t default_sink_index = pulse_glue_get_default_sink_index();
+    for (guint i = 0; i < menu_sinks->len; ++i) {
+        uint32_t index = g_array_index(menu_sinks, uint32_t, i);
+        audio_status_device *sink = audio_status_lookup_sink(index);
+        const gchar *label = sink->description ? sink->description : sink->name;
+        GtkMenuItem *item = GTK_MENU_ITEM(g_ptr_array_index(sink_items, i));
+        if (g_strcmp0(gtk_menu_item_get_label(item), label))
+            gtk_menu_item_set_label(item, label);
+        gboolean active = index == default_sink_index;
+        if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(item)) != active)
+            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item), active);
+    }
+}
 
-    for (GSList *entry = as->profiles; entry; entry = g_slist_next(entry)) {
-        // Create the item
-        audio_status_profile *profile = (audio_status_profile *)entry->data;
-        GtkWidget *item = gtk_check_menu_item_new_with_label(profile->description);
-        gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item), profile->active);
+static void patch_profile_items(void)
+{
+    guint num_profiles;
+    audio_status_profile *profiles = audio_status_get_profiles(&num_profiles);
+    audio_status *as = shared_audio_status();
+    menu_layout = as->card ? as->card->layout : 0;
+
+    // Add the items we're missing
+    while (profile_items->len < num_profiles) {
+        GtkWidget *item = gtk_check_menu_item_new_with_label("");
         gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+        g_signal_connect(G_OBJECT(item), "activate", G_CALLBACK(on_profile_item_activate),
+                GUINT_TO_POINTER(profile_items->len));
+        gtk_widget_show(item);
+        g_ptr_array_add(profile_items, item);
+    }
 
-        // Copy and keep a reference to the profile name
-        gchar *name_copy = g_strdup(profile->name);
-        profile_names = g_slist_prepend(profile_names, name_copy);
+    // And get rid of the ones we don't need anymore
+    while (profile_items->len > num_profiles) {
+        gtk_widget_destroy(GTK_WIDGET(g_ptr_array_index(profile_items,
+                        profile_items->len - 1)));
+        g_ptr_array_set_size(profile_items, profile_items->len - 1);
+    }
 
-        // Connect the signal, referecing the copy of the profile name
-        g_signal_connect(G_OBJECT(item), "activate", G_CALLBACK(on_item_activate), name_copy);
+    // Only touch what actually changed in the rest of them
+    for (guint i = 0; i < num_profiles; ++i) {
+        GtkMenuItem *item = GTK_MENU_ITEM(g_ptr_array_index(profile_items, i));
+        if (g_strcmp0(gtk_menu_item_get_label(item), profiles[i].description))
+            gtk_menu_item_set_label(item, profiles[i].description);
+        if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(item)) != profiles[i].active)
+            gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item), profiles[i].active);
     }
+}
+
+static void patch_menu(void)
+{
+    // Setting the check marks activates the items
+    patching_menu = TRUE;
+    patch_sink_items();
+    patch_profile_items();
+    patching_menu = FALSE;
+
+    // Only separate the sinks from the profiles if there are both
+    gtk_widget_set_visible(separator, sink_items->len && profile_items->len);
+
+    // There's nothing left to show if all the sinks and profiles are gone
+    if (!sink_items->len && !profile_items->len && gtk_widget_get_visible(menu))
+        gtk_menu_popdown(GTK_MENU(menu));
+}
+
+void show_popup_menu(GtkStatusIcon *status_icon)
+{
+    // Create the menu the first time around, it's kept up to date after
+    // that
+    if (!menu) {
+        menu = gtk_menu_new();
+        separator = gtk_separator_menu_item_new();
+        gtk_menu_shell_append(GTK_MENU_SHELL(menu), separator);
+        sink_items = g_ptr_array_new();
+        profile_items = g_ptr_array_new();
+        menu_sinks = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+        patch_menu();
+    }
+
+    // Nothing to do if we have no entries
+    if (!sink_items->len && !profile_items->len)
+        return;
 
     // Show it
-    gtk_widget_show_all(menu);
     gtk_menu_popup(GTK_MENU(menu), NULL, NULL, gtk_status_icon_position_menu,
             status_icon, 0, gtk_get_current_event_time());
 }
 
 void hide_popup_menu(void)
 {
-    // Nothing needs to be done at the moment
+    if (menu)
+        gtk_menu_popdown(GTK_MENU(menu));
 }
 
 gboolean is_popup_menu_visible(void)
 {
-    // Right now we can't tell, but it doesn't really matter as
-    // if the user managed to click the tray icon, the popup menu
-    // lost focus anyways and was thus dismissed
-    return FALSE;
+    return menu && gtk_widget_get_visible(menu);
 }
 
 void update_popup_menu(void)
 {
-    // Nothing needs to be done at the moment
+    // Patch the menu in place if it was built already, otherwise it'll
+    // be built with the current sinks and profiles when it's first shown
+    if (menu)
+        patch_menu();
 }
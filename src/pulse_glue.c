@@ -10,31 +10,143 @@
 #include <gtk/gtk.h>
 #include <pulse/glib-mainloop.h>
 #include <pulse/pulseaudio.h>
+#include <string.h>
 
 #include "audio_status.h"
+#include "control_socket.h"
+#include "event_log.h"
+#include "idle_trigger.h"
+#include "perf_stats.h"
 #include "popup_menu.h"
 #include "pulse_glue.h"
+#include "state_export.h"
+#include "stream_mixer.h"
+#include "trace.h"
 #include "tray_icon.h"
 #include "volume_scale.h"
 
+// Reconnection delays, in milliseconds. Each failed attempt doubles the
+// delay up to the maximum, and a random part of it is shaved off so that
+// we don't all come back at the same time
+#define RECONNECT_MIN_DELAY 100
+#define RECONNECT_MAX_DELAY 30000
+
 static pa_context *context;
 static pa_glib_mainloop *loop;
 static pa_mainloop_api *api;
 
-static gboolean subscribed = FALSE;
-static gboolean have_default_card_index = FALSE;
-static uint32_t default_card_index;
-static uint32_t default_sink_index;
+// The level meter gets one peak per fragment of a single float, at this
+// rate, so there's no actual audio to move around
+#define PEAK_RATE 25
+
+static gboolean connected = FALSE;
+static guint reconnect_attempts = 0;
+static guint reconnect_source_id = 0;
+static GFileMonitor *socket_monitor = NULL;
+
+static gchar *default_sink_name = NULL;
+static gchar *default_source_name = NULL;
+static gint64 default_sink_issued_for = 0;
+static uint32_t default_card_index = PA_INVALID_INDEX;
+static uint32_t default_sink_index = PA_INVALID_INDEX;
 static unsigned int default_sink_num_channels;
+static gboolean replaying_at_max_speed = FALSE;
+
+static pa_stream *peak_stream = NULL;
+static uint32_t peak_stream_sink_index = PA_INVALID_INDEX;
+static gboolean peak_monitor_wanted = FALSE;
+
+typedef struct {
+    const gchar *name;
+    pa_operation *(*issue)(void);
+    pa_operation *operation;
+    gboolean dirty;
+    gint64 dirty_since;
+    gint64 issued_for;
+    guint64 volume_changes_seen;
+    guint64 mute_changes_seen;
+} reload_slot;
+
+static pa_operation *issue_server_reload(void);
+static pa_operation *issue_sink_reload(void);
+static pa_operation *issue_card_reload(void);
+
+static reload_slot server_reload = { "server", issue_server_reload, NULL, FALSE, 0, 0, 0, 0 };
+static reload_slot sink_reload = { "sink", issue_sink_reload, NULL, FALSE, 0, 0, 0, 0 };
+static reload_slot card_reload = { "card", issue_card_reload, NULL, FALSE, 0, 0, 0, 0 };
+
+static GHashTable *dirty_sinks, *dirty_sources, *dirty_cards, *dirty_sink_inputs;
+static GSource *flush_reloads_trigger = NULL;
+static pulse_glue_reload_stats reload_stats;
 
-static pa_operation *sink_reload_operation = NULL;
-static guint postponed_sink_reload_timeout_id;
-static gboolean has_postponed_sink_reload = FALSE;
+// Local changes are numbered, and each write carries the number of the
+// newest change it includes. The server handles the requests of a
+// connection in order, so a query issued after a write sees its value
+typedef struct {
+    const gchar *name;
+    perf_stats_operation op;
+    void (*issue)(void);
+    pa_operation *operation;
+    gboolean pending;
+    guint64 issued;
+    guint64 coalesced;
+    guint64 changes;
+    guint64 issued_changes;
+    gboolean echo_ignored;
+} write_slot;
 
-static gboolean try_connect(gpointer data);
+static void issue_volume_write(void);
+static void issue_mute_write(void);
+
+static write_slot volume_write = { "volume", PERF_STATS_SET_VOLUME, issue_volume_write,
+    NULL, FALSE, 0, 0, 0, 0, FALSE };
+static write_slot mute_write = { "mute", PERF_STATS_SET_MUTE, issue_mute_write,
+    NULL, FALSE, 0, 0, 0, 0, FALSE };
+
+// The writes to each stream are coalesced like the ones to the default
+// sink, so that dragging one of the sliders of the mixer keeps at most one
+// write per stream in flight
+typedef struct {
+    pa_operation *operation;
+    gboolean pending;
+    gboolean echo_ignored;
+} stream_write_slot;
+
+typedef struct {
+    uint32_t index;
+    stream_write_slot volume;
+    stream_write_slot mute;
+} sink_input_writes;
+
+static GHashTable *sink_input_write_table;
+
+// The switch of the default sink in progress, which is done once the
+// server confirmed the new default and every stream was moved
+static guint sink_switch_generation = 0;
+static guint sink_switch_steps_pending = 0;
+static guint sink_switch_streams = 0;
+static gint64 sink_switch_started_at = 0;
+
+static void try_connect(void);
+static gboolean flush_reloads(gpointer data);
+static void connect_peak_stream(void);
+static void disconnect_peak_stream(void);
 static void server_info_cb(pa_context *c, const pa_server_info *info, void *data);
 static void card_info_cb(pa_context *c, const pa_card_info *info, int eol, void *data);
 static void sink_info_cb(pa_context *c, const pa_sink_info *info, int eol, void *data);
+static void source_info_cb(pa_context *c, const pa_source_info *info, int eol, void *data);
+static void sink_input_info_cb(pa_context *c, const pa_sink_input_info *info, int eol, void *data);
+
+static void sink_input_writes_destroy(gpointer data)
+{
+    // The replies to the writes in flight will find nothing to update
+    sink_input_writes *writes = (sink_input_writes *)data;
+    if (writes->volume.operation)
+        pa_operation_unref(writes->volume.operation);
+    if (writes->mute.operation)
+        pa_operation_unref(writes->mute.operation);
+    g_free(writes);
+}
 
 void pulse_glue_init(void)
 {
@@ -42,85 +154,357 @@ void pulse_glue_init(void)
     g_assert(loop);
     api = pa_glib_mainloop_get_api(loop);
     g_assert(api);
+
+    dirty_sinks = g_hash_table_new(g_direct_hash, g_direct_equal);
+    dirty_sources = g_hash_table_new(g_direct_hash, g_direct_equal);
+    dirty_cards = g_hash_table_new(g_direct_hash, g_direct_equal);
+    dirty_sink_inputs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    sink_input_write_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, sink_input_writes_destroy);
+    flush_reloads_trigger = idle_trigger_new(G_PRIORITY_HIGH_IDLE, flush_reloads);
+}
+
+static void reset_write(write_slot *slot)
+{
+    // Forget about the operation in flight and the pending value
+    if (slot->operation) {
+        pa_operation_unref(slot->operation);
+        slot->operation = NULL;
+    }
+    slot->pending = FALSE;
+    slot->changes = 0;
+    slot->issued_changes = 0;
+    slot->echo_ignored = FALSE;
+}
+
+static void reset_reload(reload_slot *slot)
+{
+    // Forget about the operation in flight and any pending events
+    if (slot->operation) {
+        pa_operation_cancel(slot->operation);
+        pa_operation_unref(slot->operation);
+        slot->operation = NULL;
+    }
+    slot->dirty = FALSE;
+    slot->issued_for = 0;
+}
+
+static void reset_reloads(void)
+{
+    reset_reload(&server_reload);
+    reset_reload(&sink_reload);
+    reset_reload(&card_reload);
+    g_hash_table_remove_all(dirty_sinks);
+    g_hash_table_remove_all(dirty_sources);
+    g_hash_table_remove_all(dirty_cards);
+    g_hash_table_remove_all(dirty_sink_inputs);
+    idle_trigger_cancel(flush_reloads_trigger);
+}
+
+static void reset_defaults(void)
+{
+    // Forget everything we knew about the server
+    g_free(default_sink_name);
+    default_sink_name = NULL;
+    g_free(default_source_name);
+    default_source_name = NULL;
+    default_sink_issued_for = 0;
+    default_sink_index = PA_INVALID_INDEX;
+    default_card_index = PA_INVALID_INDEX;
+    sink_switch_steps_pending = 0;
+    g_hash_table_remove_all(sink_input_write_table);
+    audio_status_reset_registry();
 }
 
 void pulse_glue_destroy(void)
 {
-    if (has_postponed_sink_reload)
-        g_source_remove(postponed_sink_reload_timeout_id);
-    if (sink_reload_operation)
-        pa_operation_unref(sink_reload_operation);
+    event_log_stop_replay();
+    disconnect_peak_stream();
+    if (reconnect_source_id) {
+        g_source_remove(reconnect_source_id);
+        reconnect_source_id = 0;
+    }
+    if (socket_monitor) {
+        g_file_monitor_cancel(socket_monitor);
+        g_object_unref(socket_monitor);
+        socket_monitor = NULL;
+    }
+    reset_write(&volume_write);
+    reset_write(&mute_write);
+    reset_reloads();
+    reset_defaults();
+    g_hash_table_destroy(dirty_sinks);
+    g_hash_table_destroy(dirty_sources);
+    g_hash_table_destroy(dirty_cards);
+    g_hash_table_destroy(dirty_sink_inputs);
+    g_hash_table_destroy(sink_input_write_table);
+    idle_trigger_destroy(flush_reloads_trigger);
     if (context)
         pa_context_unref(context);
     pa_glib_mainloop_free(loop);
 }
 
-static gboolean postponed_sink_reload(gpointer data)
+static pa_operation *query_sink(uint32_t index, reload_slot *slot)
 {
-    // Try again later if another sink reload operation is in progress
-    if (sink_reload_operation)
-        return TRUE;
-
-    // Start a sink reload operation
-    sink_reload_operation = pa_context_get_sink_info_by_index(context,
-            default_sink_index, sink_info_cb, NULL);
-    if (!sink_reload_operation)
+    pa_operation *oper = pa_context_get_sink_info_by_index(context,
+            index, sink_info_cb, slot);
+    perf_stats_operation_issued(PERF_STATS_SINK_INFO, oper != NULL);
+    if (!oper)
         g_printerr("pa_context_get_sink_info_by_index() failed\n");
+    return oper;
+}
+
+static pa_operation *query_sink_input(uint32_t index, reload_slot *slot)
+{
+    pa_operation *oper = pa_context_get_sink_input_info(context,
+            index, sink_input_info_cb, slot);
+    perf_stats_operation_issued(PERF_STATS_SINK_INPUT_INFO, oper != NULL);
+    if (!oper)
+        g_printerr("pa_context_get_sink_input_info() failed\n");
+    return oper;
+}
+
+static pa_operation *query_source(uint32_t index, reload_slot *slot)
+{
+    pa_operation *oper = pa_context_get_source_info_by_index(context,
+            index, source_info_cb, slot);
+    perf_stats_operation_issued(PERF_STATS_SOURCE_INFO, oper != NULL);
+    if (!oper)
+        g_printerr("pa_context_get_source_info_by_index() failed\n");
+    return oper;
+}
+
+static pa_operation *query_card(uint32_t index, reload_slot *slot)
+{
+    pa_operation *oper = pa_context_get_card_info_by_index(context,
+            index, card_info_cb, slot);
+    perf_stats_operation_issued(PERF_STATS_CARD_INFO, oper != NULL);
+    if (!oper)
+        g_printerr("pa_context_get_card_info_by_index() failed\n");
+    return oper;
+}
+
+static pa_operation *issue_server_reload(void)
+{
+    pa_operation *oper = pa_context_get_server_info(context, server_info_cb, NULL);
+    perf_stats_operation_issued(PERF_STATS_SERVER_INFO, oper != NULL);
+    if (!oper)
+        g_printerr("pa_context_get_server_info() failed\n");
+    return oper;
+}
+
+static pa_operation *issue_sink_reload(void)
+{
+    return query_sink(default_sink_index, &sink_reload);
+}
+
+static pa_operation *issue_card_reload(void)
+{
+    return query_card(default_card_index, &card_reload);
+}
+
+static void start_reload(reload_slot *slot)
+{
+    // Nothing to query if we're replaying a recording
+    if (!context)
+        return;
 
-    // We no longer have a postponed sink reload operation
-    has_postponed_sink_reload = FALSE;
+    // The reply to this query will reflect every event seen so far, and
+    // every write issued so far
+    slot->issued_for = slot->dirty ? slot->dirty_since : 0;
+    slot->volume_changes_seen = volume_write.issued_changes;
+    slot->mute_changes_seen = mute_write.issued_changes;
+    slot->dirty = FALSE;
+    slot->operation = slot->issue();
+    if (slot->operation)
+        ++reload_stats.reloads;
+}
 
+static void flush_dirty_objects(GHashTable *dirty,
+        pa_operation *(*query)(uint32_t, reload_slot *))
+{
+    // Query each of the objects that changed, just once
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, dirty);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        pa_operation *oper = query(GPOINTER_TO_UINT(key), NULL);
+        if (oper) {
+            pa_operation_unref(oper);
+            ++reload_stats.reloads;
+        }
+    }
+    g_hash_table_remove_all(dirty);
+}
+
+static gboolean flush_reloads(gpointer data)
+{
+    // Issue the queries that were requested during this main loop
+    // iteration, unless they're already in flight (in which case the
+    // follow-up query will be issued when the current one completes)
+    if (!context) {
+        reset_reloads();
+        return FALSE;
+    }
+    reload_slot *slots[] = { &server_reload, &sink_reload, &card_reload };
+    for (gsize i = 0; i < G_N_ELEMENTS(slots); ++i) {
+        if (slots[i]->dirty && !slots[i]->operation)
+            start_reload(slots[i]);
+    }
+
+    // Do the same for the objects that aren't currently shown
+    flush_dirty_objects(dirty_sinks, query_sink);
+    flush_dirty_objects(dirty_sources, query_source);
+    flush_dirty_objects(dirty_cards, query_card);
+    flush_dirty_objects(dirty_sink_inputs, query_sink_input);
     return FALSE;
 }
 
-static void run_or_postpone_sink_reload(void)
+static void schedule_flush(void)
+{
+    // Collapse all the events of this main loop iteration into a single
+    // flush, which runs before GTK+ gets to redraw anything
+    idle_trigger_fire(flush_reloads_trigger);
+}
+
+static void schedule_reload(reload_slot *slot)
 {
-    // Postpone if a sink reload operation is in progress, do it
-    // right away otherwise
-    if (sink_reload_operation) {
-        if (has_postponed_sink_reload)
-            g_source_remove(postponed_sink_reload_timeout_id);
-        postponed_sink_reload_timeout_id = g_timeout_add_seconds(1, postponed_sink_reload, NULL);
-        has_postponed_sink_reload = TRUE;
+    // Remember when the oldest event we haven't queried for arrived
+    ++reload_stats.events;
+    if (!slot->dirty) {
+        slot->dirty = TRUE;
+        slot->dirty_since = g_get_monotonic_time();
     }
-    else {
-        postponed_sink_reload(NULL);
-        return;
+    schedule_flush();
+}
+
+static void schedule_object_reload(GHashTable *dirty, uint32_t index)
+{
+    ++reload_stats.events;
+    g_hash_table_add(dirty, GUINT_TO_POINTER(index));
+    schedule_flush();
+}
+
+static void finish_reload(reload_slot *slot)
+{
+    // Get rid of the reference to the operation
+    if (slot->operation) {
+        pa_operation_unref(slot->operation);
+        slot->operation = NULL;
     }
+
+    // Issue the follow-up query right away if more events arrived
+    // while this one was in flight
+    if (slot->dirty)
+        start_reload(slot);
+}
+
+static void request_reload(reload_slot *slot)
+{
+    // Query right away, or as soon as the query in flight completes
+    if (!slot->operation) {
+        start_reload(slot);
+    }
+    else if (!slot->dirty) {
+        slot->dirty = TRUE;
+        slot->dirty_since = g_get_monotonic_time();
+    }
+}
+
+static void report_reload_latency(reload_slot *slot, gint64 issued_for)
+{
+    // Nothing to report unless this reload was triggered by an event
+    if (!issued_for)
+        return;
+
+    // Measure how long the event took to show up in the UI
+    gint64 latency = g_get_monotonic_time() - issued_for;
+    reload_stats.last_latency = latency;
+    if (latency > reload_stats.max_latency)
+        reload_stats.max_latency = latency;
+    g_debug("%s event took %" G_GINT64_FORMAT " us to show up", slot->name, latency);
 }
 
 static void event_cb(pa_context *c, pa_subscription_event_type_t type, uint32_t idx, void *data)
 {
+    if (event_log_is_recording())
+        event_log_record_event(type, idx);
+
+    gboolean removed = (type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) ==
+        PA_SUBSCRIPTION_EVENT_REMOVE;
+
     switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
         case PA_SUBSCRIPTION_EVENT_SERVER:
-            {
-                // Reload the server info
-                pa_operation *oper = pa_context_get_server_info(context, server_info_cb, NULL);
-                if (oper)
-                    pa_operation_unref(oper);
-                else
-                    g_printerr("pa_context_get_server_info() failed\n");
-            }
+            // Reload the server info
+            perf_stats_count(PERF_STATS_SERVER_EVENTS);
+            trace_instant("pulse", "server_event");
+            schedule_reload(&server_reload);
             break;
         case PA_SUBSCRIPTION_EVENT_CARD:
-            {
-                // Ignore this unless we're handling this card
-                if (idx != default_card_index)
-                    return;
-
-                // Reload the card info
-                pa_operation *oper = pa_context_get_card_info_by_index(context,
-                        default_card_index, card_info_cb, NULL);
-                if (oper)
-                    pa_operation_unref(oper);
-                else
-                    g_printerr("pa_context_get_card_info_by_index() failed\n");
+            perf_stats_count(PERF_STATS_CARD_EVENTS);
+            trace_instant("pulse", "card_event");
+            if (removed) {
+                // Forget about the card, and its profiles if it was ours
+                g_hash_table_remove(dirty_cards, GUINT_TO_POINTER(idx));
+                audio_status_remove_card(idx);
+                if (idx == default_card_index)
+                    update_popup_menu();
+            }
+            else if (idx == default_card_index) {
+                // If this is the card we're handling, reload the card info
+                schedule_reload(&card_reload);
+            }
+            else {
+                schedule_object_reload(dirty_cards, idx);
             }
             break;
         case PA_SUBSCRIPTION_EVENT_SINK:
-            // If this is the sink we're handling, try to reload the sink status
-            if (idx == default_sink_index)
-                run_or_postpone_sink_reload();
+            perf_stats_count(PERF_STATS_SINK_EVENTS);
+            trace_instant("pulse", "sink_event");
+            if (removed) {
+                // If this was the default sink, the server will tell us
+                // about the new one soon
+                g_hash_table_remove(dirty_sinks, GUINT_TO_POINTER(idx));
+                audio_status_remove_sink(idx);
+                update_popup_menu();
+            }
+            else if (idx == default_sink_index) {
+                // If this is the sink we're handling, reload the sink status
+                schedule_reload(&sink_reload);
+            }
+            else {
+                // If we're still waiting for a default sink, this one
+                // might have become it
+                schedule_object_reload(dirty_sinks, idx);
+                if (!default_sink_name)
+                    schedule_reload(&server_reload);
+            }
+            break;
+        case PA_SUBSCRIPTION_EVENT_SOURCE:
+            perf_stats_count(PERF_STATS_SOURCE_EVENTS);
+            trace_instant("pulse", "source_event");
+            if (removed) {
+                g_hash_table_remove(dirty_sources, GUINT_TO_POINTER(idx));
+                audio_status_remove_source(idx);
+            }
+            else {
+                schedule_object_reload(dirty_sources, idx);
+            }
+            break;
+        case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+            perf_stats_count(PERF_STATS_SINK_INPUT_EVENTS);
+            trace_instant("pulse", "sink_input_event");
+            if (removed) {
+                // Drop the stream and its mixer row, nothing to query
+                g_hash_table_remove(dirty_sink_inputs, GUINT_TO_POINTER(idx));
+                g_hash_table_remove(sink_input_write_table, GUINT_TO_POINTER(idx));
+                audio_status_remove_sink_input(idx);
+                update_stream_mixer_stream(idx);
+            }
+            else {
+                // Query just this stream, the others didn't change
+                schedule_object_reload(dirty_sink_inputs, idx);
+            }
             break;
         default:
             g_debug("Unhandled subscribed event type");
@@ -128,159 +512,510 @@ static void event_cb(pa_context *c, pa_subscription_event_type_t type, uint32_t
     }
 }
 
+static guint64 changes_seen_without_slot(write_slot *slot)
+{
+    // Replies come in the order the requests were made, so a reply that
+    // arrives while no write is outstanding was requested after the last
+    // one. Otherwise we can't tell, so assume it's an echo
+    return slot->operation || slot->pending ? 0 : slot->changes;
+}
+
+static gboolean accept_echo(write_slot *slot, guint64 changes_seen)
+{
+    // Take the value of the server if it saw our latest change, otherwise
+    // it's the echo of an older one and the slider would snap back to it
+    if (changes_seen >= slot->changes)
+        return TRUE;
+    perf_stats_count(PERF_STATS_ECHOES_IGNORED);
+
+    // Check again once the writes complete, or right away if there are
+    // none left to wait for
+    if (slot->operation || slot->pending)
+        slot->echo_ignored = TRUE;
+    else
+        request_reload(&sink_reload);
+    return FALSE;
+}
+
+static void apply_default_sink(audio_status_device *sink, guint64 volume_changes_seen,
+        guint64 mute_changes_seen)
+{
+    // Save the default sink and the number of volume channels
+    gboolean switched = sink->index != default_sink_index;
+    default_sink_index = sink->index;
+    default_sink_num_channels = sink->channels;
+
+    // Update the audio status, keeping our own values while the server
+    // hasn't caught up with them. A new sink has nothing to keep
+    audio_status *as = shared_audio_status();
+    if (switched || accept_echo(&volume_write, volume_changes_seen))
+        as->volume = sink->volume;
+    if (switched || accept_echo(&mute_write, mute_changes_seen))
+        as->muted = sink->muted;
+
+    // Update the tray icon and the volume scale
+    update_tray_icon();
+    update_volume_scale();
+
+    // Switch to the card of the default sink if it changed. If we don't
+    // know about the card yet, it'll be picked up when it shows up
+    if (sink->card != default_card_index) {
+        default_card_index = sink->card;
+        as->card = audio_status_lookup_card(default_card_index);
+        update_popup_menu();
+    }
+
+    // Tell the monitors, now that the active profile is the one of the
+    // new card
+    control_socket_state_changed();
+    state_export_update();
+
+    // The mixer shows the streams of the default sink, and the menu
+    // checks it
+    if (switched) {
+        update_stream_mixer();
+        update_popup_menu();
+    }
+
+    // Follow the default sink with the level meter
+    if (peak_monitor_wanted)
+        connect_peak_stream();
+}
+
+static void resolve_default_sink(void)
+{
+    // Nothing to do until we know which sink is the default one
+    if (!default_sink_name)
+        return;
+
+    // Look it up, it'll be resolved when it shows up if we don't know it yet
+    audio_status_device *sink = audio_status_lookup_sink_by_name(default_sink_name);
+    if (!sink)
+        return;
+
+    // Switch to the sink locally, no need to query the server again
+    perf_stats_mark_startup_phase("default_sink");
+    apply_default_sink(sink, G_MAXUINT64, G_MAXUINT64);
+    report_reload_latency(&server_reload, default_sink_issued_for);
+    default_sink_issued_for = 0;
+}
+
 static void card_info_cb(pa_context *c, const pa_card_info *info, int eol, void *data)
 {
     // Check if this is the termination call
-    if (eol > 0)
+    if (eol > 0) {
+        perf_stats_operation_completed(PERF_STATS_CARD_INFO, TRUE);
         return;
+    }
+
+    // Get rid of the reference to the operation
+    reload_slot *slot = (reload_slot *)data;
+    gint64 issued_for = slot ? slot->issued_for : 0;
+    if (slot)
+        finish_reload(slot);
 
     // Handle errors
     if (eol < 0 || !info) {
-        g_printerr("Sink info callback failure\n");
+        g_printerr("Card info callback failure\n");
+        if (eol < 0)
+            perf_stats_operation_completed(PERF_STATS_CARD_INFO, FALSE);
         return;
     }
+    if (event_log_is_recording())
+        event_log_record_card_info(info);
 
-    // Add the profiles to the audio status
-    audio_status_reset_profiles();
-    audio_status *as = shared_audio_status();
+    // Update the profiles of the card in place
+    audio_status_card *card = audio_status_store_card(info->index, info->name);
+    audio_status_card_begin_profile_update(card);
     for (uint32_t i = 0; i < info->n_profiles; ++i) {
-        pa_card_profile_info *info_profile = &info->profiles[i];
-        audio_status_profile *profile = g_malloc(sizeof(audio_status_profile));
-        profile->name = g_strdup(info_profile->name);
-        profile->description = g_strdup(info_profile->description);
-        profile->priority = info_profile->priority;
-        profile->active = info->active_profile == info_profile;
-        as->profiles = g_slist_append(as->profiles, profile);
+        pa_card_profile_info2 *info_profile = info->profiles2[i];
+        audio_status_card_update_profile(card, info_profile->name,
+                info_profile->description, info_profile->priority,
+                info_profile->available ? TRUE : FALSE,
+                info->active_profile2 == info_profile);
     }
-    audio_status_sort_profiles();
+    gboolean changed = audio_status_card_end_profile_update(card);
 
-    // Update the popup menu
-    update_popup_menu();
+    // Nothing else to do unless this is the card we're handling
+    if (info->index != default_card_index)
+        return;
+
+    // Update the popup menu if anything actually changed
+    audio_status *as = shared_audio_status();
+    if (as->card != card) {
+        as->card = card;
+        changed = TRUE;
+    }
+    if (changed) {
+        update_popup_menu();
+        control_socket_state_changed();
+        state_export_update();
+    }
+    report_reload_latency(&card_reload, issued_for);
 }
 
 static void sink_info_cb(pa_context *c, const pa_sink_info *info, int eol, void *data)
 {
     // Check if this is the termination call
-    if (eol > 0)
+    if (eol > 0) {
+        perf_stats_operation_completed(PERF_STATS_SINK_INFO, TRUE);
         return;
+    }
 
     // Get rid of the reference to the operation
-    g_assert(sink_reload_operation);
-    pa_operation_unref(sink_reload_operation);
-    sink_reload_operation = NULL;
+    reload_slot *slot = (reload_slot *)data;
+    gint64 issued_for = slot ? slot->issued_for : 0;
+    guint64 volume_changes_seen = slot ? slot->volume_changes_seen :
+        changes_seen_without_slot(&volume_write);
+    guint64 mute_changes_seen = slot ? slot->mute_changes_seen :
+        changes_seen_without_slot(&mute_write);
+    if (slot)
+        finish_reload(slot);
 
     // Handle errors
     if (eol < 0 || !info) {
         g_printerr("Sink info callback failure\n");
+        if (eol < 0)
+            perf_stats_operation_completed(PERF_STATS_SINK_INFO, FALSE);
         return;
     }
+    if (event_log_is_recording())
+        event_log_record_sink_info(info);
+    gint64 begin = trace_begin();
 
-    // Check if the default card changed and save it
-    gboolean default_card_changed = !have_default_card_index ||
-        default_card_index != info->card;
-    default_card_index = info->card;
-    have_default_card_index = TRUE;
+    // Store the sink in the registry
+    pa_volume_t volume = pa_cvolume_avg(&(info->volume));
+    if (volume > PA_VOLUME_NORM)
+        volume = PA_VOLUME_NORM;
+    audio_status_device device_info;
+    device_info.index = info->index;
+    device_info.name = (gchar *)info->name;
+    device_info.description = (gchar *)info->description;
+    device_info.monitor_source_name = (gchar *)info->monitor_source_name;
+    device_info.card = info->card;
+    device_info.channels = info->volume.channels;
+    device_info.volume = volume * 100.0 / PA_VOLUME_NORM;
+    device_info.muted = info->mute ? TRUE : FALSE;
+    audio_status_device *known_sink = audio_status_lookup_sink(info->index);
+    gboolean menu_changed = !known_sink ||
+        g_strcmp0(known_sink->description, info->description);
+    audio_status_device *sink = audio_status_store_sink(&device_info);
 
-    // Save the default sink and the number of volume channels
-    default_sink_index = info->index;
-    default_sink_num_channels = info->volume.channels;
-
-    // If we aren't subscribed yet, subscribe now
-    if (!subscribed) {
-        pa_context_set_subscribe_callback(context, event_cb, NULL);
-        pa_operation *oper = pa_context_subscribe(context, PA_SUBSCRIPTION_MASK_SERVER |
-                PA_SUBSCRIPTION_MASK_CARD | PA_SUBSCRIPTION_MASK_SINK, NULL, NULL);
-        if (oper)
-            pa_operation_unref(oper);
-        else
-            g_printerr("pa_context_subscribe() failed\n");
-        subscribed = TRUE;
+    // The menu lists the sinks by description
+    if (menu_changed)
+        update_popup_menu();
+
+    // Update the UI if this is the sink we're handling, or switch to it
+    // if it's the default sink we were waiting for
+    if (sink->index == default_sink_index) {
+        apply_default_sink(sink, volume_changes_seen, mute_changes_seen);
+        report_reload_latency(&sink_reload, issued_for);
+    }
+    else if (default_sink_name && !strcmp(sink->name, default_sink_name)) {
+        resolve_default_sink();
     }
+    trace_end("pulse", "sink_info", begin);
+}
 
-    // Update the audio status
+static void source_info_cb(pa_context *c, const pa_source_info *info, int eol, void *data)
+{
+    // Check if this is the termination call
+    if (eol > 0) {
+        perf_stats_operation_completed(PERF_STATS_SOURCE_INFO, TRUE);
+        return;
+    }
+
+    // Handle errors
+    if (eol < 0 || !info) {
+        g_printerr("Source info callback failure\n");
+        if (eol < 0)
+            perf_stats_operation_completed(PERF_STATS_SOURCE_INFO, FALSE);
+        return;
+    }
+    if (event_log_is_recording())
+        event_log_record_source_info(info);
+
+    // Store the source in the registry
     pa_volume_t volume = pa_cvolume_avg(&(info->volume));
     if (volume > PA_VOLUME_NORM)
         volume = PA_VOLUME_NORM;
-    audio_status *as = shared_audio_status();
-    as->volume = volume * 100.0 / PA_VOLUME_NORM;
-    as->muted = info->mute ? TRUE : FALSE;
+    audio_status_device device_info;
+    device_info.index = info->index;
+    device_info.name = (gchar *)info->name;
+    device_info.description = (gchar *)info->description;
+    device_info.monitor_source_name = NULL;
+    device_info.card = info->card;
+    device_info.channels = info->volume.channels;
+    device_info.volume = volume * 100.0 / PA_VOLUME_NORM;
+    device_info.muted = info->mute ? TRUE : FALSE;
+    audio_status_store_source(&device_info);
+}
 
-    // Update the tray icon and the volume scale
-    update_tray_icon();
-    update_volume_scale();
+static void sink_input_info_cb(pa_context *c, const pa_sink_input_info *info, int eol, void *data)
+{
+    // Check if this is the termination call
+    if (eol > 0) {
+        perf_stats_operation_completed(PERF_STATS_SINK_INPUT_INFO, TRUE);
+        return;
+    }
 
-    // Start getting information about the card if it changed
-    if (default_card_changed) {
-        pa_operation *oper = pa_context_get_card_info_by_index(context,
-                default_card_index, card_info_cb, NULL);
-        if (oper)
-            pa_operation_unref(oper);
-        else
-            g_printerr("pa_context_get_card_info_by_index() failed\n");
+    // Handle errors. Streams come and go all the time, so one that's gone
+    // by the time we query it isn't worth complaining about
+    if (eol < 0 || !info) {
+        if (!c || pa_context_errno(c) != PA_ERR_NOENTITY)
+            g_printerr("Sink input info callback failure\n");
+        if (eol < 0)
+            perf_stats_operation_completed(PERF_STATS_SINK_INPUT_INFO, FALSE);
+        return;
+    }
+    if (event_log_is_recording())
+        event_log_record_sink_input_info(info);
+
+    // Name the stream after the application, which is what users know
+    const gchar *name = pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME);
+    if (!name)
+        name = info->name;
+
+    // Store the stream in the registry
+    pa_volume_t volume = pa_cvolume_avg(&(info->volume));
+    if (volume > PA_VOLUME_NORM)
+        volume = PA_VOLUME_NORM;
+    audio_status_stream stream_info;
+    stream_info.index = info->index;
+    stream_info.name = (gchar *)name;
+    stream_info.sink = info->sink;
+    stream_info.channels = info->volume.channels;
+    stream_info.volume = volume * 100.0 / PA_VOLUME_NORM;
+    stream_info.muted = info->mute ? TRUE : FALSE;
+    stream_info.volume_writable = info->has_volume && info->volume_writable;
+
+    // Keep our own values while writes to the stream are outstanding, this
+    // may be the echo of an older one. The stream is queried again once
+    // they complete
+    sink_input_writes *writes = g_hash_table_lookup(sink_input_write_table,
+            GUINT_TO_POINTER(info->index));
+    audio_status_stream *known_stream = audio_status_lookup_sink_input(info->index);
+    if (writes && known_stream) {
+        if (writes->volume.operation || writes->volume.pending) {
+            stream_info.volume = known_stream->volume;
+            writes->volume.echo_ignored = TRUE;
+            perf_stats_count(PERF_STATS_ECHOES_IGNORED);
+        }
+        if (writes->mute.operation || writes->mute.pending) {
+            stream_info.muted = known_stream->muted;
+            writes->mute.echo_ignored = TRUE;
+            perf_stats_count(PERF_STATS_ECHOES_IGNORED);
+        }
     }
+    audio_status_store_sink_input(&stream_info);
+
+    // Refresh its row in the mixer
+    update_stream_mixer_stream(info->index);
 }
 
 static void server_info_cb(pa_context *c, const pa_server_info *info, void *data)
 {
+    // Get rid of the reference to the operation, but keep the time of
+    // the server event so that it gets reported when the new default
+    // sink shows up
+    gint64 issued_for = server_reload.issued_for;
+    finish_reload(&server_reload);
+    perf_stats_operation_completed(PERF_STATS_SERVER_INFO, info != NULL);
+
     // Handle errors
     if (!info) {
         g_printerr("Server info callback failure\n");
         return;
     }
+    if (event_log_is_recording())
+        event_log_record_server_info(info);
 
-    // Check if we have sinks at all
+    // Remember the default source for the microphone mute key
+    if (g_strcmp0(default_source_name, info->default_source_name)) {
+        g_free(default_source_name);
+        default_source_name = g_strdup(info->default_source_name);
+    }
+
+    // The sinks might not be there yet, e.g. right after the server was
+    // restarted. Keep showing what we know until one shows up, the server
+    // will be queried again when it does
     if (!info->default_sink_name) {
-        g_printerr("No default sink name (don't you have any sinks?)\n");
-        gtk_main_quit();
+        g_printerr("No default sink yet, waiting for one to show up\n");
         return;
     }
 
-    // If we have a sync reload operation in progress, get rid of it
-    if (has_postponed_sink_reload)
-        g_source_remove(postponed_sink_reload_timeout_id);
-    if (sink_reload_operation)
-        pa_operation_cancel(sink_reload_operation);
+    // Nothing to do if the default sink didn't change
+    if (!g_strcmp0(default_sink_name, info->default_sink_name))
+        return;
 
-    // Get the default sink info
-    sink_reload_operation = pa_context_get_sink_info_by_name(context,
-            info->default_sink_name, sink_info_cb, NULL);
-    if (!sink_reload_operation)
-        g_printerr("pa_context_get_sink_info_by_name() failed\n");
-    run_or_postpone_sink_reload();
+    // Switch to the new default sink, which we probably know already
+    g_free(default_sink_name);
+    default_sink_name = g_strdup(info->default_sink_name);
+    default_sink_issued_for = issued_for;
+    resolve_default_sink();
 }
 
-static void context_state_cb(pa_context *c, void *data)
+static gboolean on_reconnect_timeout(gpointer data)
 {
-    // Handle errors
-    pa_context_state_t state = pa_context_get_state(context);
-    if (state == PA_CONTEXT_FAILED) {
-        g_printerr("Failed to connect to the server, retrying soon\n");
-        pa_context_unref(context);
-        context = NULL;
-        g_timeout_add_seconds(1, try_connect, NULL);
+    reconnect_source_id = 0;
+    try_connect();
+    return FALSE;
+}
+
+static void schedule_reconnect(void)
+{
+    // Back off exponentially, with jitter, so that we don't keep waking
+    // up while the server is gone
+    guint delay = RECONNECT_MAX_DELAY;
+    if (reconnect_attempts < 16)
+        delay = MIN(RECONNECT_MIN_DELAY << reconnect_attempts, RECONNECT_MAX_DELAY);
+    delay = g_random_int_range(delay / 2, delay + 1);
+    ++reconnect_attempts;
+    g_debug("Reconnecting in %u ms", delay);
+
+    if (reconnect_source_id)
+        g_source_remove(reconnect_source_id);
+    reconnect_source_id = g_timeout_add(delay, on_reconnect_timeout, NULL);
+}
+
+static void on_socket_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+        GFileMonitorEvent event, gpointer data)
+{
+    // Only a new socket is interesting, and only while we're waiting to
+    // reconnect
+    if (event != G_FILE_MONITOR_EVENT_CREATED || !reconnect_source_id)
         return;
+
+    // The server is back, so reconnect right away and start over with the
+    // shortest delay in case it's not listening just yet
+    g_debug("The server socket reappeared, reconnecting");
+    g_source_remove(reconnect_source_id);
+    reconnect_source_id = 0;
+    reconnect_attempts = 0;
+    try_connect();
+}
+
+static void watch_server_socket(void)
+{
+    // There's nothing to watch if the server isn't the local one
+    if (g_getenv("PULSE_SERVER"))
+        return;
+
+    // Find out where the server socket lives
+    gchar *socket_path;
+    const gchar *runtime_path = g_getenv("PULSE_RUNTIME_PATH");
+    if (runtime_path)
+        socket_path = g_build_filename(runtime_path, "native", NULL);
+    else
+        socket_path = g_build_filename(g_get_user_runtime_dir(), "pulse", "native", NULL);
+
+    // Watch it, so that we know when a restarted server is back
+    GError *error = NULL;
+    GFile *file = g_file_new_for_path(socket_path);
+    socket_monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, &error);
+    if (socket_monitor) {
+        g_signal_connect(socket_monitor, "changed", G_CALLBACK(on_socket_changed), NULL);
+    }
+    else {
+        g_debug("Failed to watch %s: %s", socket_path, error->message);
+        g_error_free(error);
     }
+    g_object_unref(file);
+    g_free(socket_path);
+}
 
-    // Handle the case where the server was terminated
-    if (state == PA_CONTEXT_TERMINATED) {
-        g_debug("Server terminated, exiting...\n");
-        gtk_main_quit();
+static void handle_disconnection(void)
+{
+    // Forget about everything that was going on, the indices will be
+    // different once we're back
+    reset_write(&volume_write);
+    reset_write(&mute_write);
+    reset_reloads();
+    reset_defaults();
+    update_stream_mixer();
+    update_popup_menu();
+    disconnect_peak_stream();
+    perf_stats_forget_pending_operations();
+    pa_context_unref(context);
+    context = NULL;
+
+    // Keep showing the last known state, but let the user know it might
+    // not be accurate anymore
+    if (connected) {
+        connected = FALSE;
+        update_tray_icon();
+        control_socket_state_changed();
+        state_export_update();
+    }
+
+    perf_stats_count(PERF_STATS_RECONNECTS);
+    schedule_reconnect();
+}
+
+static void context_state_cb(pa_context *c, void *data)
+{
+    // Handle errors, and the case where the server was terminated (e.g.
+    // it was restarted after an update) in the same way
+    pa_context_state_t state = pa_context_get_state(context);
+    if (state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED) {
+        g_printerr("%s, reconnecting\n", state == PA_CONTEXT_FAILED ?
+                "Failed to connect to the server" : "The server went away");
+        handle_disconnection();
         return;
     }
 
     // Now we only handle the ready state
     if (state != PA_CONTEXT_READY)
         return;
+    perf_stats_mark_startup_phase("context_ready");
+    connected = TRUE;
+    reconnect_attempts = 0;
+    state_export_update();
 
-    // Start by getting the server information
-    pa_operation *oper = pa_context_get_server_info(context, server_info_cb, NULL);
+    // Subscribe first so that nothing changes unnoticed while we're
+    // enumerating everything
+    pa_context_set_subscribe_callback(context, event_cb, NULL);
+    pa_operation *oper = pa_context_subscribe(context, PA_SUBSCRIPTION_MASK_SERVER |
+            PA_SUBSCRIPTION_MASK_CARD | PA_SUBSCRIPTION_MASK_SINK |
+            PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_SINK_INPUT, NULL, NULL);
     if (oper)
         pa_operation_unref(oper);
     else
-        g_printerr("pa_context_get_server_info() failed\n");
+        g_printerr("pa_context_subscribe() failed\n");
+
+    // Get the server information and fill the registry in the same batch,
+    // so that the default sink is resolved locally as soon as the replies
+    // arrive, a single round trip after connecting
+    start_reload(&server_reload);
+    oper = pa_context_get_sink_info_list(context, sink_info_cb, NULL);
+    perf_stats_operation_issued(PERF_STATS_SINK_INFO, oper != NULL);
+    if (oper)
+        pa_operation_unref(oper);
+    else
+        g_printerr("pa_context_get_sink_info_list() failed\n");
+    oper = pa_context_get_source_info_list(context, source_info_cb, NULL);
+    perf_stats_operation_issued(PERF_STATS_SOURCE_INFO, oper != NULL);
+    if (oper)
+        pa_operation_unref(oper);
+    else
+        g_printerr("pa_context_get_source_info_list() failed\n");
+    oper = pa_context_get_card_info_list(context, card_info_cb, NULL);
+    perf_stats_operation_issued(PERF_STATS_CARD_INFO, oper != NULL);
+    if (oper)
+        pa_operation_unref(oper);
+    else
+        g_printerr("pa_context_get_card_info_list() failed\n");
+
+    // The streams are only listed once, events keep them current after that
+    oper = pa_context_get_sink_input_info_list(context, sink_input_info_cb, NULL);
+    perf_stats_operation_issued(PERF_STATS_SINK_INPUT_INFO, oper != NULL);
+    if (oper)
+        pa_operation_unref(oper);
+    else
+        g_printerr("pa_context_get_sink_input_info_list() failed\n");
 }
 
-static gboolean try_connect(gpointer data)
+static void try_connect(void)
 {
     // Create a new context
     pa_proplist *proplist = pa_proplist_new();
@@ -292,27 +1027,153 @@ static gboolean try_connect(gpointer data)
     // Connect the context state callback
     pa_context_set_state_callback(context, context_state_cb, NULL);
 
-    // Try to connect the context
-    if (pa_context_connect(context, NULL, PA_CONTEXT_NOFAIL, NULL) < 0) {
-        g_printerr("Unable to connect context\n");
-        gtk_main_quit();
-        return FALSE;
+    // Try to connect the context. Failures are reported to the state
+    // callback, which takes care of trying again later
+    if (pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        g_printerr("Unable to connect context, retrying soon\n");
+        if (context) {
+            pa_context_unref(context);
+            context = NULL;
+        }
+        if (!reconnect_source_id)
+            schedule_reconnect();
     }
-
-    return FALSE;
 }
 
 void pulse_glue_start(void)
 {
-    try_connect(NULL);
+    watch_server_socket();
+    try_connect();
 }
 
-void pulse_glue_sync_volume(void)
+gboolean pulse_glue_is_connected(void)
 {
-    // Nothing to do if we don't have a context
-    if (!context)
+    return connected;
+}
+
+static void replay_event(pa_subscription_event_type_t type, uint32_t idx)
+{
+    event_cb(NULL, type, idx, NULL);
+}
+
+static void replay_server_info(const pa_server_info *info)
+{
+    server_info_cb(NULL, info, NULL);
+}
+
+static void replay_sink_info(const pa_sink_info *info)
+{
+    sink_info_cb(NULL, info, 0, NULL);
+}
+
+static void replay_source_info(const pa_source_info *info)
+{
+    source_info_cb(NULL, info, 0, NULL);
+}
+
+static void replay_card_info(const pa_card_info *info)
+{
+    card_info_cb(NULL, info, 0, NULL);
+}
+
+static void replay_sink_input_info(const pa_sink_input_info *info)
+{
+    sink_input_info_cb(NULL, info, 0, NULL);
+}
+
+static void replay_finished(guint num_records, gint64 elapsed)
+{
+    g_print("Replayed %u records in %" G_GINT64_FORMAT " us\n", num_records, elapsed);
+
+    // Replaying at maximum speed is meant for profiling and testing, so
+    // there's nothing left to do once we're done
+    if (replaying_at_max_speed)
+        gtk_main_quit();
+}
+
+static const event_log_handlers replay_handlers = {
+    replay_event,
+    replay_server_info,
+    replay_sink_info,
+    replay_source_info,
+    replay_card_info,
+    replay_sink_input_info,
+    replay_finished
+};
+
+gboolean pulse_glue_start_replay(const gchar *path, gboolean max_speed)
+{
+    // Feed the recording to the same callbacks the server would call,
+    // without ever connecting to the server
+    replaying_at_max_speed = max_speed;
+    connected = TRUE;
+    return event_log_start_replay(path, max_speed, &replay_handlers);
+}
+
+static void issue_write(write_slot *slot)
+{
+    // Tag the write with the newest change, which it carries
+    slot->issued_changes = slot->changes;
+    slot->issue();
+}
+
+static void write_cb(pa_context *c, int success, void *data)
+{
+    write_slot *slot = (write_slot *)data;
+
+    // Get rid of the reference to the operation
+    if (slot->operation) {
+        pa_operation_unref(slot->operation);
+        slot->operation = NULL;
+    }
+
+    // Handle errors, our value didn't make it so it has to be replaced
+    // by the one of the server
+    perf_stats_operation_completed(slot->op, success);
+    if (!success) {
+        g_printerr("Failed to set the sink %s\n", slot->name);
+        slot->echo_ignored = TRUE;
+    }
+
+    // Send the newest value if it changed while this write was in flight
+    if (slot->pending) {
+        slot->pending = FALSE;
+        issue_write(slot);
+        return;
+    }
+
+    // We're idle, so if we ignored the server in the meantime, ask it
+    // again. The reply will carry our latest change, or the value someone
+    // else set after it
+    if (slot->echo_ignored) {
+        slot->echo_ignored = FALSE;
+        request_reload(&sink_reload);
+    }
+}
+
+static void queue_write(write_slot *slot)
+{
+    // Nothing to do if we don't have a context or a sink yet
+    if (!context || default_sink_index == PA_INVALID_INDEX)
         return;
+    ++slot->changes;
 
+    // Issue the write right away unless there's one in flight already
+    if (!slot->operation) {
+        issue_write(slot);
+        return;
+    }
+
+    // Otherwise fold the value into the pending slot, the latest value
+    // will be sent when the write in flight completes
+    if (slot->pending)
+        ++slot->coalesced;
+    else
+        slot->pending = TRUE;
+}
+
+static void issue_volume_write(void)
+{
     // Create a volume specification
     audio_status *as = shared_audio_status();
     pa_cvolume volume;
@@ -321,53 +1182,442 @@ void pulse_glue_sync_volume(void)
             as->volume * PA_VOLUME_NORM / 100);
 
     // Set the volume
-    pa_operation *oper = pa_context_set_sink_volume_by_index(context,
-            default_sink_index, &volume, NULL, NULL);
-    if (oper)
-        pa_operation_unref(oper);
+    volume_write.operation = pa_context_set_sink_volume_by_index(context,
+            default_sink_index, &volume, write_cb, &volume_write);
+    perf_stats_operation_issued(PERF_STATS_SET_VOLUME, volume_write.operation != NULL);
+    if (volume_write.operation)
+        ++volume_write.issued;
     else
         g_printerr("pa_context_set_sink_volume_by_index() failed\n");
 }
 
-void pulse_glue_sync_muted(void)
+static void issue_mute_write(void)
 {
-    // Nothing to do if we don't have a context
-    if (!context)
-        return;
-
     // Set the mute switch
-    pa_operation *oper = pa_context_set_sink_mute_by_index(context,
-            default_sink_index, shared_audio_status()->muted, NULL, NULL);
-    if (oper)
-        pa_operation_unref(oper);
+    mute_write.operation = pa_context_set_sink_mute_by_index(context,
+            default_sink_index, shared_audio_status()->muted, write_cb, &mute_write);
+    perf_stats_operation_issued(PERF_STATS_SET_MUTE, mute_write.operation != NULL);
+    if (mute_write.operation)
+        ++mute_write.issued;
     else
         g_printerr("pa_context_set_sink_mute_by_index() failed\n");
 }
 
+void pulse_glue_sync_volume(void)
+{
+    // Let the readers of the exported state see the change right away
+    state_export_update();
+    queue_write(&volume_write);
+}
+
+void pulse_glue_sync_muted(void)
+{
+    state_export_update();
+    queue_write(&mute_write);
+}
+
+static void profile_cb(pa_context *c, int success, void *data)
+{
+    perf_stats_operation_completed(PERF_STATS_SET_PROFILE, success);
+    if (!success)
+        g_printerr("Failed to set the card profile\n");
+}
+
 void pulse_glue_sync_active_profile(void)
 {
-    // Nothing to do if we don't have a context
-    if (!context)
+    // Nothing to do if we don't have a context or a card
+    if (!context || default_card_index == PA_INVALID_INDEX)
         return;
 
     // Find the active profile
-    audio_status_profile *active_profile = NULL;
-    audio_status *as = shared_audio_status();
-    uint32_t index = 0;
-    for (GSList *entry = as->profiles; entry;entry = g_slist_next(entry), ++index) {
-        audio_status_profile *profile = (audio_status_profile *)entry->data;
-        if (profile->active) {
-            active_profile = profile;
-            break;
-        }
-    }
+    audio_status_profile *active_profile = audio_status_get_active_profile();
     g_assert(active_profile);
+    state_export_update();
 
     // Sync with the server
     pa_operation *oper = pa_context_set_card_profile_by_index(context,
-            default_card_index, active_profile->name, NULL, NULL);
+            default_card_index, active_profile->name, profile_cb, NULL);
+    perf_stats_operation_issued(PERF_STATS_SET_PROFILE, oper != NULL);
     if (oper)
         pa_operation_unref(oper);
     else
         g_printerr("pa_context_set_card_profile_by_index() failed\n");
 }
+
+static void source_mute_cb(pa_context *c, int success, void *data)
+{
+    perf_stats_operation_completed(PERF_STATS_SET_SOURCE_MUTE, success);
+    if (!success)
+        g_printerr("Failed to set the source mute switch\n");
+}
+
+void pulse_glue_toggle_source_muted(void)
+{
+    // Nothing to do if we don't have a context or a source
+    if (!context || !default_source_name)
+        return;
+    audio_status_device *source = audio_status_lookup_source_by_name(default_source_name);
+    if (!source)
+        return;
+
+    // Flip the switch right away, the change event will confirm it
+    source->muted = !source->muted;
+    pa_operation *oper = pa_context_set_source_mute_by_index(context,
+            source->index, source->muted, source_mute_cb, NULL);
+    perf_stats_operation_issued(PERF_STATS_SET_SOURCE_MUTE, oper != NULL);
+    if (oper)
+        pa_operation_unref(oper);
+    else
+        g_printerr("pa_context_set_source_mute_by_index() failed\n");
+}
+
+static void issue_sink_input_volume_write(sink_input_writes *writes);
+static void issue_sink_input_mute_write(sink_input_writes *writes);
+
+static sink_input_writes *finish_sink_input_write(void *data, perf_stats_operation op,
+        int success, gboolean mute)
+{
+    // Nothing left to do if the stream is gone
+    perf_stats_operation_completed(op, success);
+    sink_input_writes *writes = g_hash_table_lookup(sink_input_write_table, data);
+    if (!writes)
+        return NULL;
+    stream_write_slot *slot = mute ? &writes->mute : &writes->volume;
+    pa_operation_unref(slot->operation);
+    slot->operation = NULL;
+    if (!success) {
+        g_printerr("Failed to set the %s of sink input %u\n",
+                mute ? "mute switch" : "volume", writes->index);
+        slot->echo_ignored = TRUE;
+    }
+
+    // Tell the caller to send the newest value if it changed in the meantime
+    if (slot->pending) {
+        slot->pending = FALSE;
+        return writes;
+    }
+
+    // Otherwise catch up with the server if we ignored it in the meantime
+    if (slot->echo_ignored) {
+        slot->echo_ignored = FALSE;
+        schedule_object_reload(dirty_sink_inputs, writes->index);
+    }
+    return NULL;
+}
+
+static void sink_input_volume_cb(pa_context *c, int success, void *data)
+{
+    sink_input_writes *writes = finish_sink_input_write(data,
+            PERF_STATS_SET_SINK_INPUT_VOLUME, success, FALSE);
+    if (writes)
+        issue_sink_input_volume_write(writes);
+}
+
+static void sink_input_mute_cb(pa_context *c, int success, void *data)
+{
+    sink_input_writes *writes = finish_sink_input_write(data,
+            PERF_STATS_SET_SINK_INPUT_MUTE, success, TRUE);
+    if (writes)
+        issue_sink_input_mute_write(writes);
+}
+
+static void issue_sink_input_volume_write(sink_input_writes *writes)
+{
+    audio_status_stream *stream = audio_status_lookup_sink_input(writes->index);
+    if (!stream)
+        return;
+
+    // Set the same volume on every channel, like for the default sink
+    pa_cvolume volume;
+    pa_cvolume_init(&volume);
+    pa_cvolume_set(&volume, stream->channels, stream->volume * PA_VOLUME_NORM / 100);
+    writes->volume.operation = pa_context_set_sink_input_volume(context, writes->index,
+            &volume, sink_input_volume_cb, GUINT_TO_POINTER(writes->index));
+    perf_stats_operation_issued(PERF_STATS_SET_SINK_INPUT_VOLUME,
+            writes->volume.operation != NULL);
+    if (!writes->volume.operation)
+        g_printerr("pa_context_set_sink_input_volume() failed\n");
+}
+
+static void issue_sink_input_mute_write(sink_input_writes *writes)
+{
+    audio_status_stream *stream = audio_status_lookup_sink_input(writes->index);
+    if (!stream)
+        return;
+
+    writes->mute.operation = pa_context_set_sink_input_mute(context, writes->index,
+            stream->muted, sink_input_mute_cb, GUINT_TO_POINTER(writes->index));
+    perf_stats_operation_issued(PERF_STATS_SET_SINK_INPUT_MUTE,
+            writes->mute.operation != NULL);
+    if (!writes->mute.operation)
+        g_printerr("pa_context_set_sink_input_mute() failed\n");
+}
+
+static sink_input_writes *lookup_sink_input_writes(uint32_t index)
+{
+    // Nothing to do without a context
+    if (!context)
+        return NULL;
+
+    // Start keeping track of the writes to this stream
+    sink_input_writes *writes = g_hash_table_lookup(sink_input_write_table,
+            GUINT_TO_POINTER(index));
+    if (!writes) {
+        writes = g_malloc0(sizeof(sink_input_writes));
+        writes->index = index;
+        g_hash_table_insert(sink_input_write_table, GUINT_TO_POINTER(index), writes);
+    }
+    return writes;
+}
+
+void pulse_glue_sync_sink_input_volume(uint32_t index)
+{
+    // Write right away, or once the write in flight completes
+    sink_input_writes *writes = lookup_sink_input_writes(index);
+    if (!writes)
+        return;
+    if (writes->volume.operation)
+        writes->volume.pending = TRUE;
+    else
+        issue_sink_input_volume_write(writes);
+}
+
+void pulse_glue_sync_sink_input_muted(uint32_t index)
+{
+    sink_input_writes *writes = lookup_sink_input_writes(index);
+    if (!writes)
+        return;
+    if (writes->mute.operation)
+        writes->mute.pending = TRUE;
+    else
+        issue_sink_input_mute_write(writes);
+}
+
+static void finish_sink_switch_step(void *data)
+{
+    // Ignore the replies to a switch that was superseded
+    if (GPOINTER_TO_UINT(data) != sink_switch_generation || !sink_switch_steps_pending)
+        return;
+    if (--sink_switch_steps_pending)
+        return;
+
+    // Everything plays on the new sink now
+    perf_stats_sink_switched(g_get_monotonic_time() - sink_switch_started_at,
+            sink_switch_streams);
+}
+
+static void set_default_sink_cb(pa_context *c, int success, void *data)
+{
+    perf_stats_operation_completed(PERF_STATS_SET_DEFAULT_SINK, success);
+    if (!success)
+        g_printerr("Failed to set the default sink\n");
+    finish_sink_switch_step(data);
+}
+
+static void move_sink_input_cb(pa_context *c, int success, void *data)
+{
+    // Some streams ask not to be moved, so this isn't worth complaining about
+    perf_stats_operation_completed(PERF_STATS_MOVE_SINK_INPUT, success);
+    if (!success)
+        g_debug("Failed to move a stream to the new default sink");
+    finish_sink_switch_step(data);
+}
+
+static void move_sink_input(gpointer key, gpointer value, gpointer data)
+{
+    // Move the streams that aren't on the new sink already
+    audio_status_stream *stream = (audio_status_stream *)value;
+    audio_status_device *sink = (audio_status_device *)data;
+    if (stream->sink == sink->index)
+        return;
+
+    pa_operation *oper = pa_context_move_sink_input_by_index(context, stream->index,
+            sink->index, move_sink_input_cb, GUINT_TO_POINTER(sink_switch_generation));
+    perf_stats_operation_issued(PERF_STATS_MOVE_SINK_INPUT, oper != NULL);
+    if (oper) {
+        pa_operation_unref(oper);
+        ++sink_switch_steps_pending;
+        ++sink_switch_streams;
+    }
+    else {
+        g_printerr("pa_context_move_sink_input_by_index() failed\n");
+    }
+}
+
+void pulse_glue_set_default_sink(uint32_t index)
+{
+    // Nothing to do if we don't have a context or the sink is gone
+    audio_status_device *sink = audio_status_lookup_sink(index);
+    if (!context || !sink)
+        return;
+
+    // Start a new switch, the replies to the previous one don't count
+    ++sink_switch_generation;
+    sink_switch_started_at = g_get_monotonic_time();
+    sink_switch_steps_pending = 0;
+    sink_switch_streams = 0;
+
+    // Make it the default for new streams
+    pa_operation *oper = pa_context_set_default_sink(context, sink->name,
+            set_default_sink_cb, GUINT_TO_POINTER(sink_switch_generation));
+    perf_stats_operation_issued(PERF_STATS_SET_DEFAULT_SINK, oper != NULL);
+    if (!oper) {
+        g_printerr("pa_context_set_default_sink() failed\n");
+        return;
+    }
+    pa_operation_unref(oper);
+    ++sink_switch_steps_pending;
+
+    // And move the streams that are playing, all at once instead of
+    // waiting for each move to complete before the next one. The server
+    // handles them in order, so they all land within one round trip
+    audio_status_foreach_sink_input(move_sink_input, sink);
+}
+
+static void peak_read_cb(pa_stream *s, size_t nbytes, void *data)
+{
+    // Look at the fragments in place, each of them is a single peak
+    // computed by the server, and only report the highest one
+    gfloat peak = 0.0;
+    gboolean have_peak = FALSE;
+    while (pa_stream_readable_size(s) > 0) {
+        const void *fragment;
+        size_t length;
+        if (pa_stream_peek(s, &fragment, &length) < 0) {
+            g_printerr("pa_stream_peek() failed\n");
+            return;
+        }
+        if (!length)
+            break;
+
+        // Holes have no data, but they still need to be dropped
+        if (fragment) {
+            const gfloat *samples = (const gfloat *)fragment;
+            for (size_t i = 0; i < length / sizeof(gfloat); ++i) {
+                if (samples[i] > peak)
+                    peak = samples[i];
+            }
+            have_peak = TRUE;
+        }
+        pa_stream_drop(s);
+        perf_stats_count(PERF_STATS_PEAK_FRAGMENTS);
+    }
+
+    if (have_peak)
+        update_volume_scale_level(MIN(peak, 1.0));
+}
+
+static void peak_suspended_cb(pa_stream *s, void *data)
+{
+    // Nothing is coming through while the sink is suspended
+    if (pa_stream_is_suspended(s))
+        update_volume_scale_level(0.0);
+}
+
+static void peak_state_cb(pa_stream *s, void *data)
+{
+    // Give up on the stream if it failed, e.g. because the sink went away.
+    // A new one is created if the default sink changes
+    pa_stream_state_t state = pa_stream_get_state(s);
+    if (state == PA_STREAM_FAILED) {
+        g_printerr("The level meter stream failed\n");
+        disconnect_peak_stream();
+        update_volume_scale_level(0.0);
+    }
+}
+
+static void connect_peak_stream(void)
+{
+    // Nothing to do if we're already watching the default sink
+    if (!context || default_sink_index == PA_INVALID_INDEX)
+        return;
+    if (peak_stream && peak_stream_sink_index == default_sink_index)
+        return;
+    disconnect_peak_stream();
+
+    // Find the monitor source of the default sink
+    audio_status_device *sink = audio_status_lookup_sink(default_sink_index);
+    if (!sink || !sink->monitor_source_name)
+        return;
+
+    // Let the server do the peak detection and send us just a few floats
+    // per second. The stream doesn't keep the sink from being suspended,
+    // there's nothing to show if nothing is playing anyways
+    pa_sample_spec spec;
+    spec.format = PA_SAMPLE_FLOAT32;
+    spec.rate = PEAK_RATE;
+    spec.channels = 1;
+    pa_buffer_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.maxlength = (uint32_t)-1;
+    attr.fragsize = sizeof(gfloat);
+
+    peak_stream = pa_stream_new(context, "Level meter", &spec, NULL);
+    if (!peak_stream) {
+        g_printerr("pa_stream_new() failed\n");
+        return;
+    }
+    pa_stream_set_read_callback(peak_stream, peak_read_cb, NULL);
+    pa_stream_set_suspended_callback(peak_stream, peak_suspended_cb, NULL);
+    pa_stream_set_state_callback(peak_stream, peak_state_cb, NULL);
+    if (pa_stream_connect_record(peak_stream, sink->monitor_source_name, &attr,
+                PA_STREAM_DONT_MOVE | PA_STREAM_PEAK_DETECT | PA_STREAM_ADJUST_LATENCY |
+                PA_STREAM_DONT_INHIBIT_AUTO_SUSPEND) < 0) {
+        g_printerr("pa_stream_connect_record() failed\n");
+        disconnect_peak_stream();
+        return;
+    }
+    peak_stream_sink_index = default_sink_index;
+}
+
+static void disconnect_peak_stream(void)
+{
+    if (!peak_stream)
+        return;
+    pa_stream_set_read_callback(peak_stream, NULL, NULL);
+    pa_stream_set_suspended_callback(peak_stream, NULL, NULL);
+    pa_stream_set_state_callback(peak_stream, NULL, NULL);
+    if (pa_stream_get_state(peak_stream) == PA_STREAM_READY ||
+            pa_stream_get_state(peak_stream) == PA_STREAM_CREATING)
+        pa_stream_disconnect(peak_stream);
+    pa_stream_unref(peak_stream);
+    peak_stream = NULL;
+    peak_stream_sink_index = PA_INVALID_INDEX;
+}
+
+void pulse_glue_start_peak_monitor(void)
+{
+    // The stream only exists while someone is looking at the meter
+    peak_monitor_wanted = TRUE;
+    connect_peak_stream();
+}
+
+void pulse_glue_stop_peak_monitor(void)
+{
+    peak_monitor_wanted = FALSE;
+    disconnect_peak_stream();
+}
+
+const gchar *pulse_glue_get_default_sink_name(void)
+{
+    // Only report the default sink once we're actually handling it
+    return default_sink_index != PA_INVALID_INDEX ? default_sink_name : NULL;
+}
+
+uint32_t pulse_glue_get_default_sink_index(void)
+{
+    return default_sink_index;
+}
+
+void pulse_glue_get_write_stats(pulse_glue_write_stats *stats)
+{
+    stats->volume_writes_issued = volume_write.issued;
+    stats->volume_writes_coalesced = volume_write.coalesced;
+    stats->mute_writes_issued = mute_write.issued;
+    stats->mute_writes_coalesced = mute_write.coalesced;
+}
+
+void pulse_glue_get_reload_stats(pulse_glue_reload_stats *stats)
+{
+    *stats = reload_stats;
+}
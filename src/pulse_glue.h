@@ -10,11 +10,40 @@
 #ifndef PULSE_GLUE_H
 #define PULSE_GLUE_H
 
+#include <glib.h>
+#include <stdint.h>
+
+typedef struct {
+    guint64 volume_writes_issued;
+    guint64 volume_writes_coalesced;
+    guint64 mute_writes_issued;
+    guint64 mute_writes_coalesced;
+} pulse_glue_write_stats;
+
+typedef struct {
+    guint64 events;
+    guint64 reloads;
+    gint64 last_latency;
+    gint64 max_latency;
+} pulse_glue_reload_stats;
+
 void pulse_glue_init(void);
 void pulse_glue_destroy(void);
 void pulse_glue_start(void);
+gboolean pulse_glue_is_connected(void);
+gboolean pulse_glue_start_replay(const gchar *path, gboolean max_speed);
 void pulse_glue_sync_volume(void);
 void pulse_glue_sync_muted(void);
 void pulse_glue_sync_active_profile(void);
+void pulse_glue_toggle_source_muted(void);
+void pulse_glue_sync_sink_input_volume(uint32_t index);
+void pulse_glue_sync_sink_input_muted(uint32_t index);
+void pulse_glue_set_default_sink(uint32_t index);
+void pulse_glue_start_peak_monitor(void);
+void pulse_glue_stop_peak_monitor(void);
+const gchar *pulse_glue_get_default_sink_name(void);
+uint32_t pulse_glue_get_default_sink_index(void);
+void pulse_glue_get_write_stats(pulse_glue_write_stats *stats);
+void pulse_glue_get_reload_stats(pulse_glue_reload_stats *stats);
 
 #endif
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Runs pa-applet-bench against a private PulseAudio daemon that only has
+# a null sink, so that no hardware (and no running session) is involved.
+#
+
+BENCH=${1:-./pa-applet-bench}
+
+if ! pulseaudio --version > /dev/null 2>&1; then
+    echo "Error: pulseaudio is required to run the benchmarks" >&2
+    exit 1
+fi
+
+# Give the daemon its own runtime and state directories
+dir=$(mktemp -d)
+export XDG_RUNTIME_DIR="$dir"
+export PULSE_RUNTIME_PATH="$dir/pulse"
+export PULSE_STATE_PATH="$dir/state"
+export HOME="$dir"
+unset PULSE_SERVER
+
+pulseaudio -n --daemonize=no --exit-idle-time=-1 --use-pid-file=no \
+    --realtime=no --high-priority=no --log-level=error \
+    --load=module-native-protocol-unix \
+    --load="module-null-sink sink_name=bench" &
+daemon=$!
+export PA_BENCH_SERVER_PID=$daemon
+trap 'kill $daemon 2> /dev/null; wait $daemon 2> /dev/null; rm -rf "$dir"' EXIT INT TERM
+
+# Wait for the daemon to accept connections
+tries=0
+while [ ! -S "$PULSE_RUNTIME_PATH/native" ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ]; then
+        echo "Error: the PulseAudio daemon didn't start" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+"$BENCH"
@@ -0,0 +1,146 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "audio_status.h"
+#include "pa-applet-state.h"
+#include "pulse_glue.h"
+#include "state_export.h"
+
+static int state_fd = -1;
+static pa_applet_state *state = NULL;
+
+static void begin_update(void)
+{
+    // Readers retry while the sequence number is odd
+    __atomic_store_n(&state->sequence, state->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_update(void)
+{
+    ++state->changes;
+    __atomic_store_n(&state->sequence, state->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void state_export_start(void)
+{
+    // Reuse the file left behind by a previous instance, so that readers
+    // that still have it mapped keep working
+    gchar *path = g_build_filename(g_get_user_runtime_dir(),
+            PA_APPLET_STATE_FILE_NAME, NULL);
+    state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (state_fd < 0) {
+        g_printerr("Failed to open %s: %s\n", path, g_strerror(errno));
+        g_free(path);
+        return;
+    }
+
+    // Leave the file alone if another instance is publishing its state
+    // there, the lock goes away with the instance that holds it
+    if (flock(state_fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK)
+            g_printerr("Another instance is publishing its state in %s\n", path);
+        else
+            g_printerr("Failed to lock %s: %s\n", path, g_strerror(errno));
+        close(state_fd);
+        state_fd = -1;
+        g_free(path);
+        return;
+    }
+    if (ftruncate(state_fd, sizeof(pa_applet_state)) < 0) {
+        g_printerr("Failed to resize %s: %s\n", path, g_strerror(errno));
+        close(state_fd);
+        state_fd = -1;
+        g_free(path);
+        return;
+    }
+    g_free(path);
+
+    // Map it, every update is just a few stores from now on
+    void *shared = mmap(NULL, sizeof(pa_applet_state), PROT_READ | PROT_WRITE,
+            MAP_SHARED, state_fd, 0);
+    if (shared == MAP_FAILED) {
+        g_printerr("Failed to map the state file: %s\n", g_strerror(errno));
+        close(state_fd);
+        state_fd = -1;
+        return;
+    }
+    state = (pa_applet_state *)shared;
+
+    // Start over with an empty state, but keep counting the changes. An
+    // update left halfway by a crashed instance is finished here
+    if (state->sequence & 1)
+        ++state->sequence;
+    begin_update();
+    state->magic = PA_APPLET_STATE_MAGIC;
+    state->version = PA_APPLET_STATE_VERSION;
+    state->flags = PA_APPLET_STATE_RUNNING;
+    state->volume = 0.0;
+    state->sink[0] = '\0';
+    state->profile[0] = '\0';
+    end_update();
+    state_export_update();
+}
+
+void state_export_stop(void)
+{
+    if (!state)
+        return;
+
+    // Tell the readers that what they see won't be updated anymore
+    begin_update();
+    state->flags &= ~PA_APPLET_STATE_RUNNING;
+    end_update();
+
+    munmap(state, sizeof(pa_applet_state));
+    state = NULL;
+    close(state_fd);
+    state_fd = -1;
+}
+
+void state_export_update(void)
+{
+    // Nothing to do if we're not publishing the state
+    if (!state)
+        return;
+
+    // Find out what the state is now
+    audio_status *as = shared_audio_status();
+    const gchar *sink_name = pulse_glue_get_default_sink_name();
+    audio_status_profile *profile = audio_status_get_active_profile();
+    const gchar *profile_name = profile ? profile->name : "";
+    if (!sink_name)
+        sink_name = "";
+    uint32_t flags = PA_APPLET_STATE_RUNNING;
+    if (pulse_glue_is_connected())
+        flags |= PA_APPLET_STATE_CONNECTED;
+    if (as->muted)
+        flags |= PA_APPLET_STATE_MUTED;
+
+    // Only publish actual changes, the readers go by the change counter
+    if (state->volume == as->volume && state->flags == flags &&
+            !strncmp(state->sink, sink_name, PA_APPLET_STATE_NAME_SIZE - 1) &&
+            !strncmp(state->profile, profile_name, PA_APPLET_STATE_NAME_SIZE - 1))
+        return;
+
+    begin_update();
+    state->volume = as->volume;
+    state->flags = flags;
+    g_strlcpy(state->sink, sink_name, PA_APPLET_STATE_NAME_SIZE);
+    g_strlcpy(state->profile, profile_name, PA_APPLET_STATE_NAME_SIZE);
+    end_update();
+}
@@ -0,0 +1,17 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef STATE_EXPORT_H
+#define STATE_EXPORT_H
+
+void state_export_start(void);
+void state_export_stop(void);
+void state_export_update(void);
+
+#endif
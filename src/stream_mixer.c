@@ -0,0 +1,305 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#define MIXER_MIN_WIDTH 280
+#define MIXER_MIN_HEIGHT 120
+#define STREAM_NAME_WIDTH 16
+
+// Past this many streams waiting to be refreshed, it's cheaper to just
+// look at all of them the next time the mixer is shown
+#define MAX_DIRTY_STREAMS 256
+
+#include <gtk/gtk.h>
+#include <string.h>
+
+#include "audio_status.h"
+#include "perf_stats.h"
+#include "pulse_glue.h"
+#include "stream_mixer.h"
+#include "ui_refresh.h"
+
+typedef struct {
+    uint32_t index;
+    GtkWidget *box, *label, *scale, *mute_button;
+    gboolean updating;
+} stream_row;
+
+static GtkWidget *mixer = NULL, *row_box;
+static gboolean active = FALSE;
+
+// The rows being shown by stream index, and the hidden ones that can be
+// reused for the next streams instead of creating new widgets
+static GHashTable *rows = NULL;
+static GPtrArray *spare_rows = NULL;
+
+// The streams that changed since the last refresh, or all of them
+static GHashTable *dirty_streams = NULL;
+static gboolean all_dirty = TRUE;
+
+static void on_scale_value_change(GtkRange *range, gpointer data)
+{
+    // Nothing to do if we changed the scale value programatically
+    stream_row *row = (stream_row *)data;
+    if (row->updating)
+        return;
+
+    // Update the stream volume and sync with the server
+    audio_status_stream *stream = audio_status_lookup_sink_input(row->index);
+    if (!stream)
+        return;
+    stream->volume = gtk_range_get_value(range);
+    pulse_glue_sync_sink_input_volume(row->index);
+}
+
+static void on_mute_toggled(GtkToggleButton *button, gpointer data)
+{
+    stream_row *row = (stream_row *)data;
+    if (row->updating)
+        return;
+
+    audio_status_stream *stream = audio_status_lookup_sink_input(row->index);
+    if (!stream)
+        return;
+    stream->muted = gtk_toggle_button_get_active(button);
+    pulse_glue_sync_sink_input_muted(row->index);
+}
+
+static stream_row *create_row(void)
+{
+    stream_row *row = g_malloc0(sizeof(stream_row));
+    row->box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 4);
+
+    // The name of the application
+    row->label = gtk_label_new(NULL);
+    gtk_label_set_ellipsize(GTK_LABEL(row->label), PANGO_ELLIPSIZE_END);
+    gtk_label_set_width_chars(GTK_LABEL(row->label), STREAM_NAME_WIDTH);
+    gtk_widget_set_halign(row->label, GTK_ALIGN_START);
+    gtk_box_pack_start(GTK_BOX(row->box), row->label, FALSE, FALSE, 0);
+    gtk_widget_show(row->label);
+
+    // Its volume
+    row->scale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0.0, 100.0, 1.0);
+    gtk_scale_set_draw_value(GTK_SCALE(row->scale), FALSE);
+    gtk_box_pack_start(GTK_BOX(row->box), row->scale, TRUE, TRUE, 0);
+    gtk_widget_show(row->scale);
+
+    // And its mute switch
+    row->mute_button = gtk_toggle_button_new();
+    gtk_button_set_image(GTK_BUTTON(row->mute_button),
+            gtk_image_new_from_icon_name("audio-volume-muted", GTK_ICON_SIZE_MENU));
+    gtk_button_set_relief(GTK_BUTTON(row->mute_button), GTK_RELIEF_NONE);
+    gtk_widget_set_tooltip_text(row->mute_button, "Mute");
+    gtk_box_pack_start(GTK_BOX(row->box), row->mute_button, FALSE, FALSE, 0);
+    gtk_widget_show(row->mute_button);
+
+    // The row is reused for other streams, so the handlers look up the
+    // stream it's showing at the time
+    g_signal_connect(G_OBJECT(row->scale), "value-changed",
+            G_CALLBACK(on_scale_value_change), row);
+    g_signal_connect(G_OBJECT(row->mute_button), "toggled",
+            G_CALLBACK(on_mute_toggled), row);
+
+    gtk_box_pack_start(GTK_BOX(row_box), row->box, FALSE, FALSE, 0);
+    return row;
+}
+
+static stream_row *acquire_row(uint32_t index)
+{
+    // Reuse a hidden row if there's one, new streams go at the bottom
+    stream_row *row;
+    if (spare_rows->len) {
+        row = g_ptr_array_remove_index_fast(spare_rows, spare_rows->len - 1);
+        gtk_box_reorder_child(GTK_BOX(row_box), row->box, -1);
+    }
+    else {
+        row = create_row();
+    }
+    row->index = index;
+    g_hash_table_insert(rows, GUINT_TO_POINTER(index), row);
+    gtk_widget_show(row->box);
+    return row;
+}
+
+static void release_row(stream_row *row)
+{
+    // Keep the widgets around for the next stream
+    gtk_widget_hide(row->box);
+    g_hash_table_remove(rows, GUINT_TO_POINTER(row->index));
+    g_ptr_array_add(spare_rows, row);
+}
+
+static void render_stream(uint32_t index)
+{
+    // Only the streams of the default sink are shown
+    audio_status_stream *stream = audio_status_lookup_sink_input(index);
+    stream_row *row = g_hash_table_lookup(rows, GUINT_TO_POINTER(index));
+    if (!stream || stream->sink != pulse_glue_get_default_sink_index()) {
+        if (row)
+            release_row(row);
+        return;
+    }
+    if (!row)
+        row = acquire_row(index);
+
+    // Only touch the widgets that show something that changed
+    gboolean changed = FALSE;
+    row->updating = TRUE;
+    const gchar *name = stream->name ? stream->name : "";
+    if (strcmp(gtk_label_get_text(GTK_LABEL(row->label)), name)) {
+        gtk_label_set_text(GTK_LABEL(row->label), name);
+        gtk_widget_set_tooltip_text(row->label, name);
+        changed = TRUE;
+    }
+    if (gtk_range_get_value(GTK_RANGE(row->scale)) != stream->volume) {
+        gtk_range_set_value(GTK_RANGE(row->scale), stream->volume);
+        changed = TRUE;
+    }
+    if (gtk_widget_get_sensitive(row->scale) != stream->volume_writable) {
+        gtk_widget_set_sensitive(row->scale, stream->volume_writable);
+        changed = TRUE;
+    }
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(row->mute_button)) != stream->muted) {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(row->mute_button), stream->muted);
+        changed = TRUE;
+    }
+    row->updating = FALSE;
+
+    if (changed)
+        perf_stats_count(PERF_STATS_STREAM_MIXER_UPDATES);
+}
+
+static void mark_stream_dirty(gpointer key, gpointer value, gpointer data)
+{
+    g_hash_table_add(dirty_streams, key);
+}
+
+GtkWidget *create_stream_mixer(void)
+{
+    // Put the streams next to the volume scale, scrolling when there are
+    // more of them than fit
+    mixer = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    GtkWidget *separator = gtk_separator_new(GTK_ORIENTATION_VERTICAL);
+    gtk_box_pack_start(GTK_BOX(mixer), separator, FALSE, FALSE, 0);
+    gtk_widget_show(separator);
+
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
+            GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_min_content_width(GTK_SCROLLED_WINDOW(scrolled_window),
+            MIXER_MIN_WIDTH);
+    gtk_scrolled_window_set_min_content_height(GTK_SCROLLED_WINDOW(scrolled_window),
+            MIXER_MIN_HEIGHT);
+    gtk_box_pack_start(GTK_BOX(mixer), scrolled_window, TRUE, TRUE, 0);
+    gtk_widget_show(scrolled_window);
+
+    GtkWidget *viewport = gtk_viewport_new(NULL, NULL);
+    gtk_viewport_set_shadow_type(GTK_VIEWPORT(viewport), GTK_SHADOW_NONE);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), viewport);
+    gtk_widget_show(viewport);
+
+    row_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_container_add(GTK_CONTAINER(viewport), row_box);
+    gtk_widget_show(row_box);
+
+    // Start with every stream we already know about
+    rows = g_hash_table_new(g_direct_hash, g_direct_equal);
+    spare_rows = g_ptr_array_new();
+    dirty_streams = g_hash_table_new(g_direct_hash, g_direct_equal);
+    all_dirty = TRUE;
+
+    // The mixer is only shown when the volume scale is opened, and only
+    // if there are streams
+    return mixer;
+}
+
+void destroy_stream_mixer(void)
+{
+    // The widgets go away along with the window, only the rows are ours
+    if (!mixer)
+        return;
+    GHashTableIter iter;
+    gpointer row;
+    g_hash_table_iter_init(&iter, rows);
+    while (g_hash_table_iter_next(&iter, NULL, &row))
+        g_free(row);
+    g_hash_table_destroy(rows);
+    rows = NULL;
+    for (guint i = 0; i < spare_rows->len; ++i)
+        g_free(g_ptr_array_index(spare_rows, i));
+    g_ptr_array_free(spare_rows, TRUE);
+    spare_rows = NULL;
+    g_hash_table_destroy(dirty_streams);
+    dirty_streams = NULL;
+    all_dirty = TRUE;
+    active = FALSE;
+    mixer = NULL;
+}
+
+void activate_stream_mixer(gboolean activate)
+{
+    // Catch up with what changed while we weren't shown
+    active = activate && mixer;
+    if (active)
+        render_stream_mixer();
+    else if (mixer)
+        gtk_widget_hide(mixer);
+}
+
+void update_stream_mixer(void)
+{
+    // Look at every stream, e.g. because the default sink changed
+    all_dirty = TRUE;
+    if (dirty_streams)
+        g_hash_table_remove_all(dirty_streams);
+    if (active)
+        ui_refresh_invalidate(UI_REFRESH_STREAM_MIXER);
+}
+
+void update_stream_mixer_stream(uint32_t index)
+{
+    // Nothing to remember if we'll look at every stream anyways
+    if (all_dirty || !dirty_streams)
+        return;
+    if (g_hash_table_size(dirty_streams) >= MAX_DIRTY_STREAMS) {
+        update_stream_mixer();
+        return;
+    }
+    g_hash_table_add(dirty_streams, GUINT_TO_POINTER(index));
+    if (active)
+        ui_refresh_invalidate(UI_REFRESH_STREAM_MIXER);
+}
+
+void render_stream_mixer(void)
+{
+    // Wait until we're shown, the changes are kept until then
+    if (!active)
+        return;
+
+    // Look at the streams we're showing and the ones we know about
+    if (all_dirty) {
+        GHashTableIter iter;
+        gpointer key;
+        g_hash_table_iter_init(&iter, rows);
+        while (g_hash_table_iter_next(&iter, &key, NULL))
+            g_hash_table_add(dirty_streams, key);
+        audio_status_foreach_sink_input(mark_stream_dirty, NULL);
+        all_dirty = FALSE;
+    }
+
+    // Refresh just the streams that changed
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, dirty_streams);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        render_stream(GPOINTER_TO_UINT(key));
+    g_hash_table_remove_all(dirty_streams);
+
+    // Hide the whole mixer if there's nothing playing
+    gtk_widget_set_visible(mixer, g_hash_table_size(rows) > 0);
+}
@@ -0,0 +1,23 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef STREAM_MIXER_H
+#define STREAM_MIXER_H
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+
+GtkWidget *create_stream_mixer(void);
+void destroy_stream_mixer(void);
+void activate_stream_mixer(gboolean activate);
+void update_stream_mixer(void);
+void update_stream_mixer_stream(uint32_t index);
+void render_stream_mixer(void);
+
+#endif
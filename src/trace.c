@@ -0,0 +1,166 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+// How many events we remember, must be a power of two
+#define TRACE_BUFFER_SIZE 4096
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct {
+    const gchar *category;
+    const gchar *name;
+    gint64 time;
+    gint64 duration;
+    guint64 id;
+    gchar phase;
+} trace_event;
+
+// The most recent events, always recorded so that there's something to
+// look at when an interaction was slow. Recording an event is just a few
+// stores, nothing is formatted until the trace is written
+static trace_event events[TRACE_BUFFER_SIZE];
+static guint64 num_events = 0;
+
+static gchar *trace_file_path = NULL;
+static guint signal_source_id = 0;
+
+static inline trace_event *next_event(void)
+{
+    return &events[num_events++ & (TRACE_BUFFER_SIZE - 1)];
+}
+
+static gboolean on_write_signal(gpointer data)
+{
+    // Write to the file we were given, or to a new one in the temporary
+    // directory so that the trace can be taken from any instance
+    if (trace_file_path) {
+        trace_write(trace_file_path);
+    }
+    else {
+        gchar *name = g_strdup_printf("pa-applet-%d.trace.json", (int)getpid());
+        gchar *path = g_build_filename(g_get_tmp_dir(), name, NULL);
+        if (trace_write(path))
+            g_printerr("Trace written to %s\n", path);
+        g_free(path);
+        g_free(name);
+    }
+    return TRUE;
+}
+
+void trace_init(const gchar *path)
+{
+    // Write the trace whenever we're asked to, and on exit if we have a
+    // file to write it to
+    trace_file_path = g_strdup(path);
+    signal_source_id = g_unix_signal_add(SIGUSR2, on_write_signal, NULL);
+}
+
+void trace_destroy(void)
+{
+    if (signal_source_id) {
+        g_source_remove(signal_source_id);
+        signal_source_id = 0;
+    }
+    if (trace_file_path) {
+        trace_write(trace_file_path);
+        g_free(trace_file_path);
+        trace_file_path = NULL;
+    }
+}
+
+gint64 trace_begin(void)
+{
+    return g_get_monotonic_time();
+}
+
+void trace_end(const gchar *category, const gchar *name, gint64 begin)
+{
+    trace_event *event = next_event();
+    event->category = category;
+    event->name = name;
+    event->time = begin;
+    event->duration = g_get_monotonic_time() - begin;
+    event->phase = 'X';
+}
+
+void trace_instant(const gchar *category, const gchar *name)
+{
+    trace_event *event = next_event();
+    event->category = category;
+    event->name = name;
+    event->time = g_get_monotonic_time();
+    event->phase = 'i';
+}
+
+void trace_async_begin(const gchar *category, const gchar *name, guint64 id)
+{
+    trace_event *event = next_event();
+    event->category = category;
+    event->name = name;
+    event->time = g_get_monotonic_time();
+    event->id = id;
+    event->phase = 'b';
+}
+
+void trace_async_end(const gchar *category, const gchar *name, guint64 id)
+{
+    trace_event *event = next_event();
+    event->category = category;
+    event->name = name;
+    event->time = g_get_monotonic_time();
+    event->id = id;
+    event->phase = 'e';
+}
+
+gboolean trace_write(const gchar *path)
+{
+    // Write the events in the Trace Event Format, which both chrome://tracing
+    // and Perfetto open. Times are in microseconds of the monotonic clock
+    int pid = (int)getpid();
+    GString *text = g_string_new("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    g_string_append_printf(text, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"pa-applet\"}}", pid, pid);
+
+    // Start with the oldest event we still have
+    guint64 first = num_events > TRACE_BUFFER_SIZE ? num_events - TRACE_BUFFER_SIZE : 0;
+    for (guint64 i = first; i < num_events; ++i) {
+        const trace_event *event = &events[i & (TRACE_BUFFER_SIZE - 1)];
+        g_string_append_printf(text, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+                "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d", event->name,
+                event->category, event->phase, event->time, pid, pid);
+        switch (event->phase) {
+            case 'X':
+                g_string_append_printf(text, ",\"dur\":%" G_GINT64_FORMAT, event->duration);
+                break;
+            case 'b':
+            case 'e':
+                g_string_append_printf(text, ",\"id\":\"0x%" G_GINT64_MODIFIER "x\"", event->id);
+                break;
+            default:
+                break;
+        }
+        g_string_append_c(text, '}');
+    }
+    g_string_append(text, "\n]}\n");
+
+    // Replace the file atomically so that viewers never see half of it
+    GError *error = NULL;
+    gboolean ok = g_file_set_contents(path, text->str, text->len, &error);
+    if (!ok) {
+        g_printerr("Failed to write %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(text, TRUE);
+    return ok;
+}
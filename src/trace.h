@@ -0,0 +1,26 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <glib.h>
+
+// The categories and names of the events must be string literals, they
+// are only referenced until the trace is written
+void trace_init(const gchar *path);
+void trace_destroy(void);
+gint64 trace_begin(void);
+void trace_end(const gchar *category, const gchar *name, gint64 begin);
+void trace_instant(const gchar *category, const gchar *name);
+void trace_async_begin(const gchar *category, const gchar *name, guint64 id);
+void trace_async_end(const gchar *category, const gchar *name, guint64 id);
+gboolean trace_write(const gchar *path);
+
+#endif
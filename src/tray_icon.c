@@ -9,16 +9,28 @@
 
 #include <gtk/gtk.h>
 #include <glib.h>
-#include <string.h>
 
 #include "audio_status.h"
+#include "perf_stats.h"
 #include "popup_menu.h"
 #include "pulse_glue.h"
 #include "tray_icon.h"
+#include "ui_refresh.h"
 #include "volume_scale.h"
 
+#define TOOLTIP_TEXT_SIZE 32
+#define RECONNECTING_TOOLTIP_TEXT "Reconnecting to PulseAudio..."
+
 static GtkStatusIcon *tray_icon = NULL;
 static gboolean updated_once = FALSE;
+static void (*shown_cb)(void) = NULL;
+
+// Every tooltip we can show, indexed by mute state and volume level
+static gchar tooltip_texts[2][101][TOOLTIP_TEXT_SIZE];
+
+// What the tray icon currently shows
+static const gchar *rendered_icon_name = NULL;
+static const gchar *rendered_tooltip_text = NULL;
 
 static void on_activate(GtkStatusIcon *status_icon, gpointer data)
 {
@@ -115,17 +127,37 @@ static gboolean on_button_release(GtkStatusIcon *status_icon, GdkEventButton *ev
     return TRUE;
 }
 
+static void on_embedded_changed(GObject *object, GParamSpec *pspec, gpointer data)
+{
+    // This is as far as startup goes, the user can see us from now on
+    if (gtk_status_icon_is_embedded(tray_icon))
+        perf_stats_mark_startup_phase("embedded");
+}
+
 void create_tray_icon(void)
 {
+    // Format the tooltips once and for all
+    for (int volume = 0; volume <= 100; ++volume) {
+        g_snprintf(tooltip_texts[0][volume], TOOLTIP_TEXT_SIZE, "Volume: %d%%", volume);
+        g_snprintf(tooltip_texts[1][volume], TOOLTIP_TEXT_SIZE, "Volume: %d%% (muted)", volume);
+    }
+
     tray_icon = gtk_status_icon_new();
     g_signal_connect(G_OBJECT(tray_icon), "activate", G_CALLBACK(on_activate), NULL);
     g_signal_connect(G_OBJECT(tray_icon), "popup-menu", G_CALLBACK(on_menu), NULL);
     g_signal_connect(G_OBJECT(tray_icon), "scroll_event", G_CALLBACK(on_scroll), NULL);
     g_signal_connect(G_OBJECT(tray_icon), "button-press-event", G_CALLBACK(on_button_release), NULL);
+    g_signal_connect(G_OBJECT(tray_icon), "notify::embedded", G_CALLBACK(on_embedded_changed), NULL);
+}
+
+void set_tray_icon_shown_callback(void (*cb)(void))
+{
+    shown_cb = cb;
 }
 
 void destroy_tray_icon(void)
 {
+    ui_refresh_cancel();
     if (tray_icon) {
         gtk_widget_destroy(GTK_WIDGET(tray_icon));
         tray_icon = NULL;
@@ -139,12 +171,17 @@ void update_tray_icon(void)
     // Yes, we've been updated once now
     updated_once = TRUE;
 
-    // Get the new tray icon name and tooltip text format
+    // Refresh the tray icon and the volume scale before the next frame
+    ui_refresh_invalidate(UI_REFRESH_TRAY_ICON | UI_REFRESH_VOLUME_SCALE);
+}
+
+void render_tray_icon(void)
+{
+    // Get the new tray icon name and tooltip text
     audio_status *as = shared_audio_status();
-    gchar *icon_name, *tooltip_text_format;
+    const gchar *icon_name;
     if (as->muted) {
         icon_name = "audio-volume-muted";
-        tooltip_text_format = "Volume: %d%% (muted)";
     }
     else {
         if (as->volume < 100.0 / 3)
@@ -153,24 +190,36 @@ void update_tray_icon(void)
             icon_name = "audio-volume-medium";
         else
             icon_name = "audio-volume-high";
-        tooltip_text_format = "Volume: %d%%";
     }
-
-    // Update the icon name
-    gtk_status_icon_set_from_icon_name(tray_icon, icon_name);
-
-    // Update the tooltip
-    gsize buffer_size = (strlen(tooltip_text_format) + 5) * sizeof(gchar);
-    gchar *tooltip_text = g_malloc0(buffer_size);
-    if (tooltip_text) {
-        g_snprintf(tooltip_text, buffer_size, tooltip_text_format, (int)(as->volume));
-        gtk_status_icon_set_tooltip_text(tray_icon, tooltip_text);
-        g_free(tooltip_text);
+    int volume = CLAMP((int)(as->volume), 0, 100);
+    const gchar *tooltip_text = tooltip_texts[as->muted ? 1 : 0][volume];
+
+    // Keep showing the last known state while we're trying to reconnect,
+    // it'll be refreshed as soon as we're back
+    if (!pulse_glue_is_connected())
+        tooltip_text = RECONNECTING_TOOLTIP_TEXT;
+
+    // Only touch what actually changed, the strings above are all static
+    // so comparing the pointers is enough
+    if (icon_name != rendered_icon_name || tooltip_text != rendered_tooltip_text)
+        perf_stats_count(PERF_STATS_TRAY_ICON_UPDATES);
+    // The benchmark has no icon to show them on, but goes through the rest
+    if (icon_name != rendered_icon_name) {
+        gboolean first = rendered_icon_name == NULL;
+        if (tray_icon)
+            gtk_status_icon_set_from_icon_name(tray_icon, icon_name);
+        rendered_icon_name = icon_name;
+
+        // Let everything that can wait know that the first icon is up
+        if (first) {
+            perf_stats_mark_startup_phase("icon_shown");
+            if (shown_cb)
+                shown_cb();
+        }
+    }
+    if (tooltip_text != rendered_tooltip_text) {
+        if (tray_icon)
+            gtk_status_icon_set_tooltip_text(tray_icon, tooltip_text);
+        rendered_tooltip_text = tooltip_text;
     }
-
-    // Update the volume scale or the popup menu if needed
-    if (is_volume_scale_visible())
-        update_volume_scale();
-    else if (is_popup_menu_visible())
-        update_popup_menu();
 }
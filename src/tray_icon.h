@@ -15,5 +15,7 @@
 void create_tray_icon(void);
 void destroy_tray_icon(void);
 void update_tray_icon(void);
+void render_tray_icon(void);
+void set_tray_icon_shown_callback(void (*cb)(void));
 
 #endif
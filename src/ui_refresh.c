@@ -0,0 +1,60 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#include <gtk/gtk.h>
+
+#include "idle_trigger.h"
+#include "stream_mixer.h"
+#include "trace.h"
+#include "tray_icon.h"
+#include "ui_refresh.h"
+#include "volume_scale.h"
+
+static guint pending_targets = 0;
+static GSource *refresh_trigger = NULL;
+
+static gboolean refresh(gpointer data)
+{
+    // Take the pending targets
+    gint64 begin = trace_begin();
+    guint targets = pending_targets;
+    pending_targets = 0;
+
+    // Each of these only touches the widgets if what they show changed
+    if (targets & UI_REFRESH_TRAY_ICON)
+        render_tray_icon();
+    if (targets & UI_REFRESH_VOLUME_SCALE)
+        render_volume_scale();
+    if (targets & UI_REFRESH_LEVEL_METER)
+        render_volume_scale_level();
+    if (targets & UI_REFRESH_STREAM_MIXER)
+        render_stream_mixer();
+    trace_end("ui", "ui_refresh", begin);
+    return FALSE;
+}
+
+void ui_refresh_invalidate(guint targets)
+{
+    // Collapse all the invalidations that happen before the next frame into
+    // a single refresh, which runs after the server replies were handled
+    // but right before GDK gets to lay out and paint anything
+    pending_targets |= targets;
+    if (!refresh_trigger)
+        refresh_trigger = idle_trigger_new(GDK_PRIORITY_REDRAW - 10, refresh);
+    idle_trigger_fire(refresh_trigger);
+}
+
+void ui_refresh_cancel(void)
+{
+    if (refresh_trigger) {
+        idle_trigger_destroy(refresh_trigger);
+        refresh_trigger = NULL;
+    }
+    pending_targets = 0;
+}
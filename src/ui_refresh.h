@@ -0,0 +1,25 @@
+/*
+ * This file is part of pa-applet.
+ *
+ * © 2012 Fernando Tarlá Cardoso Lemos
+ *
+ * Refer to the LICENSE file for licensing information.
+ *
+ */
+
+#ifndef UI_REFRESH_H
+#define UI_REFRESH_H
+
+#include <glib.h>
+
+typedef enum {
+    UI_REFRESH_TRAY_ICON = 1 << 0,
+    UI_REFRESH_VOLUME_SCALE = 1 << 1,
+    UI_REFRESH_LEVEL_METER = 1 << 2,
+    UI_REFRESH_STREAM_MIXER = 1 << 3
+} ui_refresh_target;
+
+void ui_refresh_invalidate(guint targets);
+void ui_refresh_cancel(void);
+
+#endif
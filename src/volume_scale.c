@@ -12,14 +12,29 @@
 #include <gtk/gtk.h>
 
 #include "audio_status.h"
+#include "perf_stats.h"
 #include "pulse_glue.h"
+#include "stream_mixer.h"
+#include "ui_refresh.h"
 #include "volume_scale.h"
 
-static GtkWidget *window = NULL, *scale;
+static GtkWidget *window = NULL, *scale, *level_bar;
 static gboolean changing_scale_value = FALSE;
+static gdouble pending_level = 0.0;
+static gboolean have_pending_level = FALSE;
 static gboolean visible = FALSE, flashing = FALSE;
 static guint flashing_timeout_id;
 
+// The geometry of the monitors, refreshed only when they change
+static GArray *monitor_rects = NULL;
+static GdkScreen *watched_screen = NULL;
+static gulong monitors_changed_id = 0;
+
+// When the popup was asked to be shown, until it's drawn
+static gint64 show_requested_at = 0;
+
+static void on_pointer_press(GtkWidget *widget, GdkEventButton *event, gpointer data);
+
 static void on_scale_value_change(GtkRange *range, gpointer data)
 {
     // Nothing to do if we changed the scale value programatically
@@ -31,6 +46,52 @@ static void on_scale_value_change(GtkRange *range, gpointer data)
     pulse_glue_sync_volume();
 }
 
+static void set_scale_value(void)
+{
+    // Nothing to do if the scale already shows the right volume level
+    gdouble volume = shared_audio_status()->volume;
+    if (gtk_range_get_value(GTK_RANGE(scale)) == volume)
+        return;
+
+    perf_stats_count(PERF_STATS_VOLUME_SCALE_UPDATES);
+    changing_scale_value = TRUE;
+    gtk_range_set_value(GTK_RANGE(scale), volume);
+    changing_scale_value = FALSE;
+}
+
+static void on_monitors_changed(GdkScreen *screen, gpointer data)
+{
+    // Cache the geometry of every monitor
+    gint num_monitors = gdk_screen_get_n_monitors(screen);
+    g_array_set_size(monitor_rects, num_monitors);
+    for (gint i = 0; i < num_monitors; ++i)
+        gdk_screen_get_monitor_geometry(screen, i,
+                &g_array_index(monitor_rects, GdkRectangle, i));
+}
+
+static const GdkRectangle *find_monitor_rect(gint x, gint y)
+{
+    // Find the monitor that contains the point, or settle for the first
+    // one like GDK would
+    for (guint i = 0; i < monitor_rects->len; ++i) {
+        const GdkRectangle *rect = &g_array_index(monitor_rects, GdkRectangle, i);
+        if (x >= rect->x && x < rect->x + rect->width &&
+                y >= rect->y && y < rect->y + rect->height)
+            return rect;
+    }
+    return monitor_rects->len ? &g_array_index(monitor_rects, GdkRectangle, 0) : NULL;
+}
+
+static gboolean on_window_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    // Account for how long it took for the popup to show up
+    if (show_requested_at) {
+        perf_stats_popup_shown(g_get_monotonic_time() - show_requested_at);
+        show_requested_at = 0;
+    }
+    return FALSE;
+}
+
 static void create_volume_scale(void)
 {
     // Create a popup window
@@ -41,21 +102,60 @@ static void create_volume_scale(void)
     gtk_window_set_keep_above(GTK_WINDOW(window), TRUE);
     gtk_window_set_default_size(GTK_WINDOW(window), 0, 120);
 
+    // Put the scale and the level meter side by side
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_container_add(GTK_CONTAINER(window), box);
+    gtk_widget_show(box);
+
     // Create the scale and add it to the window
     scale = gtk_scale_new_with_range(GTK_ORIENTATION_VERTICAL, 0.0, 100.0, 1.0);
     gtk_scale_set_draw_value(GTK_SCALE(scale), FALSE);
     gtk_range_set_inverted(GTK_RANGE(scale), TRUE);
-    gtk_container_add(GTK_CONTAINER(window), scale);
+    gtk_box_pack_start(GTK_BOX(box), scale, TRUE, TRUE, 0);
     gtk_widget_show(scale);
 
-    // Connect the value changed signal
+    // Create the level meter, which shows the peaks of what's playing
+    level_bar = gtk_level_bar_new();
+    gtk_orientable_set_orientation(GTK_ORIENTABLE(level_bar), GTK_ORIENTATION_VERTICAL);
+    gtk_level_bar_set_inverted(GTK_LEVEL_BAR(level_bar), TRUE);
+    gtk_box_pack_start(GTK_BOX(box), level_bar, FALSE, FALSE, 0);
+    gtk_widget_show(level_bar);
+
+    // And the streams that are playing, shown only when the volume scale
+    // is opened from the tray icon
+    gtk_box_pack_start(GTK_BOX(box), create_stream_mixer(), TRUE, TRUE, 0);
+
+    // Connect the signals, once and for all
     g_signal_connect(G_OBJECT(scale), "value-changed", G_CALLBACK(on_scale_value_change), NULL);
+    g_signal_connect_after(G_OBJECT(window), "button_press_event", G_CALLBACK(on_pointer_press), NULL);
+    g_signal_connect_after(G_OBJECT(window), "draw", G_CALLBACK(on_window_draw), NULL);
+
+    // Keep track of the monitors
+    watched_screen = gtk_widget_get_screen(window);
+    monitor_rects = g_array_new(FALSE, FALSE, sizeof(GdkRectangle));
+    on_monitors_changed(watched_screen, NULL);
+    monitors_changed_id = g_signal_connect(G_OBJECT(watched_screen), "monitors-changed",
+            G_CALLBACK(on_monitors_changed), NULL);
+}
+
+void prepare_volume_scale(void)
+{
+    // Get the widgets created and realized ahead of time, so that the
+    // first popup is as quick as the following ones
+    if (!window) {
+        create_volume_scale();
+        gtk_widget_realize(window);
+    }
 }
 
 void destroy_volume_scale(void)
 {
     // Get rid of the popup window
     if (window) {
+        g_signal_handler_disconnect(watched_screen, monitors_changed_id);
+        g_array_free(monitor_rects, TRUE);
+        monitor_rects = NULL;
+        destroy_stream_mixer();
         gtk_widget_destroy(window);
         window = NULL;
     }
@@ -72,9 +172,7 @@ static void do_show_volume_scale(GdkRectangle *rect_or_null)
         g_source_remove(flashing_timeout_id);
 
     // Update the volume level
-    changing_scale_value = TRUE;
-    gtk_range_set_value(GTK_RANGE(scale), shared_audio_status()->volume);
-    changing_scale_value = FALSE;
+    set_scale_value();
 
     if (rect_or_null) {
         // Determine where the window will be
@@ -84,13 +182,10 @@ static void do_show_volume_scale(GdkRectangle *rect_or_null)
         gint y = rect_or_null->y - size_y;
 
         // Find the coordinates of the monitor
-        GdkRectangle monitor_rect;
-        GdkScreen *screen = gtk_widget_get_screen(window);
-        gint monitor = gdk_screen_get_monitor_at_point(screen, rect_or_null->x, rect_or_null->y);
-        gdk_screen_get_monitor_geometry(screen, monitor, &monitor_rect);
+        const GdkRectangle *monitor_rect = find_monitor_rect(rect_or_null->x, rect_or_null->y);
 
         // If the Y position is outside the monitor rect, the tray is at the top
-        if (y < monitor_rect.y) {
+        if (monitor_rect && y < monitor_rect->y) {
             y = rect_or_null->y + rect_or_null->height;
         }
 
@@ -127,9 +222,17 @@ static void on_pointer_press(GtkWidget *widget, GdkEventButton *event, gpointer
 
 void show_volume_scale(GdkRectangle *rect_or_null)
 {
-    // Actually show the volume scale
+    // Actually show the volume scale along with the streams, timing it
+    // until it's drawn
+    show_requested_at = g_get_monotonic_time();
+    if (!window)
+        create_volume_scale();
+    activate_stream_mixer(TRUE);
     do_show_volume_scale(rect_or_null);
 
+    // Start watching the level, but not for flashes, they're too short
+    pulse_glue_start_peak_monitor();
+
     // Find the pointer device, if possible
     GdkDevice *device = gtk_get_current_event_device();
     if (device && gdk_device_get_source(device) == GDK_SOURCE_KEYBOARD)
@@ -140,7 +243,6 @@ void show_volume_scale(GdkRectangle *rect_or_null)
     }
 
     // Grab it so we can hide the scale when the user clicks outside it
-    g_signal_connect_after(G_OBJECT(window), "button_press_event", G_CALLBACK(on_pointer_press), NULL);
     gdk_device_grab(device, gtk_widget_get_window(window), GDK_OWNERSHIP_NONE,
             TRUE, GDK_BUTTON_PRESS_MASK, NULL, GDK_CURRENT_TIME);
     gdk_flush();
@@ -171,7 +273,10 @@ void flash_volume_scale(GdkRectangle *rect_or_null)
         return;
     }
 
-    // We're not visible, so show the volume scale and set up the timeout
+    // We're not visible, so show the volume scale and set up the timeout.
+    // The streams would make it too busy for a flash
+    if (window)
+        activate_stream_mixer(FALSE);
     do_show_volume_scale(rect_or_null);
     flashing_timeout_id = g_timeout_add(FLASH_TIMEOUT, on_flash_timeout, NULL);
     flashing = TRUE;
@@ -190,6 +295,13 @@ void hide_volume_scale(void)
     // Hide the window
     gtk_widget_hide(window);
 
+    // Stop watching the level and the streams, and start from scratch the
+    // next time
+    activate_stream_mixer(FALSE);
+    pulse_glue_stop_peak_monitor();
+    gtk_level_bar_set_value(GTK_LEVEL_BAR(level_bar), 0.0);
+    have_pending_level = FALSE;
+
     // No longer visible, no longer flashing
     visible = FALSE;
     flashing = FALSE;
@@ -201,11 +313,32 @@ gboolean is_volume_scale_visible(void)
 }
 
 void update_volume_scale(void)
+{
+    // Refresh the volume level before the next frame
+    ui_refresh_invalidate(UI_REFRESH_VOLUME_SCALE);
+}
+
+void render_volume_scale(void)
 {
     // Update the volume level only if we're visible
-    if (visible) {
-        changing_scale_value = TRUE;
-        gtk_range_set_value(GTK_RANGE(scale), shared_audio_status()->volume);
-        changing_scale_value = FALSE;
-    }
+    if (visible)
+        set_scale_value();
+}
+
+void update_volume_scale_level(gdouble level)
+{
+    // Keep the highest peak until the next frame, so that short peaks
+    // aren't lost when several of them arrive in between
+    if (!have_pending_level || level > pending_level)
+        pending_level = level;
+    have_pending_level = TRUE;
+    ui_refresh_invalidate(UI_REFRESH_LEVEL_METER);
+}
+
+void render_volume_scale_level(void)
+{
+    // Show the level once per frame at most
+    if (visible && have_pending_level)
+        gtk_level_bar_set_value(GTK_LEVEL_BAR(level_bar), pending_level);
+    have_pending_level = FALSE;
 }
@@ -12,11 +12,15 @@
 
 #include <gtk/gtk.h>
 
+void prepare_volume_scale(void);
 void destroy_volume_scale(void);
 void show_volume_scale(GdkRectangle *rect_or_null);
 void flash_volume_scale(GdkRectangle *rect_or_null);
 void hide_volume_scale(void);
 gboolean is_volume_scale_visible(void);
 void update_volume_scale(void);
+void render_volume_scale(void);
+void update_volume_scale_level(gdouble level);
+void render_volume_scale_level(void);
 
 #endif